@@ -1,3 +1,39 @@
 #include "accelerator.h"
 
 Accelerator::~Accelerator() {}
+
+bool Accelerator::intersectFirst(
+  const Ray& r,
+  const Geom* emitter,
+  Intersection* isectOut
+) const {
+  return intersect(r, isectOut) && isectOut->geom == emitter;
+}
+
+size_t Accelerator::intersectMany(
+  const Ray* rays,
+  size_t count,
+  RayHit* hitsOut
+) const {
+  size_t numHits = 0;
+  for (size_t i = 0; i < count; ++i) {
+    RayHit& hit = hitsOut[numHits];
+    if (intersect(rays[i], &hit.isect)) {
+      hit.index = i;
+      numHits++;
+    }
+  }
+
+  return numHits;
+}
+
+void Accelerator::occludedMany(
+  const Ray* rays,
+  const float* maxDists,
+  size_t count,
+  bool* occludedOut
+) const {
+  for (size_t i = 0; i < count; ++i) {
+    occludedOut[i] = intersectShadow(rays[i], maxDists[i]);
+  }
+}
@@ -1,9 +1,16 @@
 #pragma once
+#include "core.h"
 #include <vector>
 
 class Geom;
-struct Ray;
-struct Intersection;
+
+/**
+ * The result of a ray in a batch that hit some geometry.
+ */
+struct RayHit {
+  size_t index; /**< The index of the ray within its batch. */
+  Intersection isect; /**< The intersection information for the ray. */
+};
 
 class Accelerator {
 public:
@@ -29,4 +36,65 @@ public:
    * @returns       true if any geom hit within maxDist, otherwise false
    */
   virtual bool intersectShadow(const Ray& r, float maxDist) const = 0;
+
+  /**
+   * Determines whether the first object that a given ray hits is the given
+   * emitter, i.e. whether the emitter is visible along the ray. This answers
+   * in one traversal what would otherwise take an intersection test with the
+   * emitter plus a shadow ray up to it.
+   *
+   * The default implementation calls Accelerator::intersect and compares the
+   * geom that was hit.
+   *
+   * @param r              the ray to trace
+   * @param emitter        the (refined) geom that should be hit first
+   * @param isectOut [out] the intersection information if the emitter was
+   *                       hit first, otherwise unspecified; the pointer must
+   *                       not be null
+   * @returns              true if the first geom hit is the emitter
+   */
+  virtual bool intersectFirst(
+    const Ray& r,
+    const Geom* emitter,
+    Intersection* isectOut
+  ) const;
+
+  /**
+   * Determines what object (if any) each ray in a batch intersects. Only the
+   * rays that hit some geometry produce a hit record, so the records form a
+   * compact list of the surviving rays, in the same order as the rays.
+   *
+   * The default implementation calls Accelerator::intersect for each ray.
+   *
+   * @param rays          the rays to intersect
+   * @param count         the number of rays
+   * @param hitsOut [out] receives one record per ray that hit some geometry;
+   *                      must have room for count records
+   * @returns             the number of hit records written
+   */
+  virtual size_t intersectMany(
+    const Ray* rays,
+    size_t count,
+    RayHit* hitsOut
+  ) const;
+
+  /**
+   * Determines, for each shadow ray in a batch, if any object intersects it
+   * within its maximum distance.
+   *
+   * The default implementation calls Accelerator::intersectShadow for each
+   * ray.
+   *
+   * @param rays              the shadow rays to test
+   * @param maxDists          the maximum distance to check for each ray
+   * @param count             the number of rays
+   * @param occludedOut [out] whether each ray hit some geom within its
+   *                          maximum distance
+   */
+  virtual void occludedMany(
+    const Ray* rays,
+    const float* maxDists,
+    size_t count,
+    bool* occludedOut
+  ) const;
 };
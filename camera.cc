@@ -1,16 +1,10 @@
 #include "camera.h"
 #include "light.h"
+#include "wavefront.h"
+#include <memory>
 #include <iostream>
 #include <chrono>
 
-#ifdef _WIN32
-  #include <ppl.h>
-  namespace parallel = Concurrency;
-#else
-  #include <tbb/tbb.h>
-  namespace parallel = tbb;
-#endif
-
 using std::max;
 using std::min;
 namespace chrono = std::chrono;
@@ -23,10 +17,12 @@ Camera::Camera(
   float fov,
   float len,
   float fStop
-) : accel(objs), focalLength(len),
+) : accel(objs), emitters(), lightTree(), guide(objs), focalLength(len),
     lensRadius((len / fStop) * 0.5f), // Diameter = focalLength / fStop.
     camToWorldXform(xform),
-    masterRng(), rowSeeds(size_t(hh)), img(ww, hh), iters(0)
+    samplerSeed(Randomness().nextUnsigned()), nextSampleIndex(0),
+    img(ww, hh), scheduler(ww, hh), iters(0), opts(), lastTraceSeconds(0),
+    lastSnapshotSeconds(0), writer(), lastWrittenIteration(0), lastWriteTime()
 {
   // Calculate ray-tracing vectors.
   float halfFocalPlaneUp;
@@ -50,6 +46,10 @@ Camera::Camera(
       g->refine(emitters);
     }
   }
+
+  // Bound the emitters hierarchically, so that the lights that matter most
+  // at each point get more of the shadow rays.
+  lightTree = LightBVH(emitters);
 }
 
 Camera::Camera(const Node& n)
@@ -63,6 +63,53 @@ Camera::Camera(const Node& n)
            n.getFloat("fov"), n.getFloat("focalLength"),
            n.getFloat("fStop")) {}
 
+void Camera::setOptions(const RenderOptions& o) {
+  opts = o;
+  img.setAdaptiveThreshold(opts.adaptiveThreshold);
+  img.setFeatureOutput(opts.featureOutput);
+  img.setFilterImportanceSampling(opts.filterImportanceSampling);
+  writer.setFormat(opts.compression, opts.fullFloatOutput);
+  if (opts.deterministic) {
+    samplerSeed = opts.seed;
+  }
+}
+
+Ray Camera::generateRay(
+  Sampler& sampler,
+  int x,
+  int y,
+  float* posX,
+  float* posY
+) const {
+  Vec2 u = sampler.next2D();
+  float offsetX = img.sampleFilterOffset(u[0]);
+  float offsetY = img.sampleFilterOffset(u[1]);
+
+  *posY = float(y) + offsetY;
+  *posX = float(x) + offsetX;
+
+  return generateRayAt(sampler, *posX, *posY);
+}
+
+Ray Camera::generateRayAt(Sampler& sampler, float posX, float posY) const {
+  float fracY = posY / (float(img.h) - 1.0f);
+  float fracX = posX / (float(img.w) - 1.0f);
+
+  // Implement depth of field by jittering the eye.
+  Vec offset(focalPlaneRight * fracX, focalPlaneUp * fracY, 0);
+  Vec lookAt = focalPlaneOrigin + offset;
+
+  Vec eye(0, 0, 0);
+  math::areaSampleDisk(sampler.next2D(), &eye[0], &eye[1]);
+  eye = eye * lensRadius;
+
+  Vec eyeWorld = camToWorldXform * eye;
+  Vec lookAtWorld = camToWorldXform * lookAt;
+  Vec dir = (lookAtWorld - eyeWorld).normalized();
+
+  return Ray(eyeWorld, dir);
+}
+
 void Camera::renderOnce(
   std::string name
 ) {
@@ -71,108 +118,418 @@ void Camera::renderOnce(
   std::cout << "Iteration " << iters;
   chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
 
-  // Seed the per-row RNGs.
-  for (int y = 0; y < img.h; ++y) {
-    rowSeeds[size_t(y)] = masterRng.nextUnsigned();
-  }
+  // Trace paths in parallel, one tile at a time per thread.
+  scheduler.run([&](const Tile& tile) {
+    std::unique_ptr<Sampler> sampler =
+      Sampler::create(opts.sampler, samplerSeed);
+    sampler->startIteration(nextSampleIndex, img.getSamplesPerPixel());
 
-  // Trace paths in parallel using TBB (Linux/Mac) or PPL (Windows).
-  parallel::parallel_for(0, img.h, [&](int y) {
-    Randomness rng(rowSeeds[size_t(y)]);
-    std::vector<RenderVertex> sharedEyePath;
-    sharedEyePath.reserve(INITIAL_PATH_LENGTH);
+    if (opts.integrator == IntegratorType::WAVEFRONT) {
+      WavefrontIntegrator wavefront(*this);
+      wavefront.renderTile(*sampler, tile, img);
+      return;
+    }
 
-    for (int x = 0; x < img.w; ++x) {
-      for (int samp = 0; samp < img.samplesPerPixel; ++samp) {
-        float offsetY = rng.nextFloat(-img.filterWidth, img.filterWidth);
-        float offsetX = rng.nextFloat(-img.filterWidth, img.filterWidth);
+    // Camera rays are traced in packets that run across the samples of
+    // neighboring pixels; the rest of each path is traced one ray at a time.
+    // The direct-lighting shadow rays of a packet's paths are queued and
+    // tested together once the paths are done (unless guiding needs them).
+    const int packetSize = Embree::getPacketSize();
+    ShadowQueue shadowQueue;
+    ShadowQueue* shadows = opts.pathGuiding ? nullptr : &shadowQueue;
+
+    Ray packetRays[Embree::MAX_PACKET_SIZE];
+    Intersection packetIsects[Embree::MAX_PACKET_SIZE];
+    bool packetHits[Embree::MAX_PACKET_SIZE];
+    float packetPosX[Embree::MAX_PACKET_SIZE];
+    float packetPosY[Embree::MAX_PACKET_SIZE];
+    int packetX[Embree::MAX_PACKET_SIZE];
+    int packetY[Embree::MAX_PACKET_SIZE];
+    int packetSample[Embree::MAX_PACKET_SIZE];
+    Vec packetL[Embree::MAX_PACKET_SIZE];
+    Image::Features packetFeatures[Embree::MAX_PACKET_SIZE];
+    int count = 0;
+
+    Image::TileBuffer buffer = img.startTile(tile);
+
+    auto flushPacket = [&]() {
+      accel.intersectPacket(packetRays, count, packetIsects, packetHits);
+
+      for (int i = 0; i < count; ++i) {
+        packetL[i] = Vec(0, 0, 0);
+        packetFeatures[i] = Image::Features();
+        if (packetHits[i]) {
+          sampler->startPixelSample(packetX[i], packetY[i], packetSample[i]);
+          packetL[i] = trace(
+            *sampler, packetRays[i], &packetIsects[i], shadows, size_t(i),
+            &packetFeatures[i]
+          );
+        }
+      }
+
+      shadowQueue.flush(accel, [&](size_t owner, const Vec& L) {
+        packetL[owner] += L;
+      });
+
+      for (int i = 0; i < count; ++i) {
+        img.setSample(
+          buffer, packetX[i], packetY[i], packetPosX[i], packetPosY[i],
+          clampRadiance(packetL[i]), packetFeatures[i]
+        );
+      }
+
+      count = 0;
+    };
+
+    for (int y = tile.y0; y < tile.y1; ++y) {
+      for (int x = tile.x0; x < tile.x1; ++x) {
+        if (!img.isPixelActive(x, y)) {
+          // Skip pixels that adaptive sampling considers converged.
+          continue;
+        }
+
+        for (int samp = 0; samp < img.getSamplesPerPixel(); ++samp) {
+          sampler->startPixelSample(x, y, samp);
+          packetRays[count] = generateRay(
+            *sampler, x, y, &packetPosX[count], &packetPosY[count]
+          );
+          packetX[count] = x;
+          packetY[count] = y;
+          packetSample[count] = samp;
+          count++;
+
+          if (count == packetSize) {
+            flushPacket();
+          }
+        }
+      }
+    }
 
-        float posY = float(y) + offsetY;
-        float posX = float(x) + offsetX;
+    if (count > 0) {
+      flushPacket();
+    }
 
-        float fracY = posY / (float(img.h) - 1.0f);
-        float fracX = posX / (float(img.w) - 1.0f);
+    img.finishTile(buffer);
+  });
 
-        // Implement depth of field by jittering the eye.
-        Vec offset(focalPlaneRight * fracX, focalPlaneUp * fracY, 0);
-        Vec lookAt = focalPlaneOrigin + offset;
+  // The next iteration continues the sample sequences where this one ended.
+  nextSampleIndex += unsigned(img.getSamplesPerPixel());
 
-        Vec eye(0, 0, 0);
-        math::areaSampleDisk(rng, &eye[0], &eye[1]);
-        eye = eye * lensRadius;
+  // Process and write the output file at the end of this iteration.
+  img.commitSamples();
+  if (opts.pathGuiding) {
+    guide.update();
+  }
+  chrono::steady_clock::time_point commitTime = chrono::steady_clock::now();
+  if (isWriteDue()) {
+    writeOutput(name);
+  }
+
+  // End timer.
+  chrono::steady_clock::time_point endTime = chrono::steady_clock::now();
+  chrono::duration<float> runTime =
+    chrono::duration_cast<chrono::duration<float>>(endTime - startTime);
+  lastTraceSeconds =
+    chrono::duration_cast<chrono::duration<float>>(commitTime - startTime)
+      .count();
+  std::cout << " [" << runTime.count() << " seconds; "
+    << img.getSamplesPerPixel() << " spp; ";
+  scheduler.printTimings(std::cout);
+  if (opts.adaptiveThreshold > 0.0f) {
+    std::cout << "; " << img.activePixelCount() << " pixels still active";
+  }
+  std::cout << "]\n";
+}
 
-        Vec eyeWorld = camToWorldXform * eye;
-        Vec lookAtWorld = camToWorldXform * lookAt;
-        Vec dir = (lookAtWorld - eyeWorld).normalized();
+float Camera::renderPreview(
+  std::string name,
+  int scale
+) {
+  std::cout << "Preview 1/" << scale;
+  chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
 
-        Vec L = trace(rng, Ray(eyeWorld, dir), sharedEyePath);
-        img.setSample(x, y, posX, posY, samp, L);
+  const int blocksW = (img.w + scale - 1) / scale;
+  const int blocksH = (img.h + scale - 1) / scale;
+  std::vector<Vec> blockColors(size_t(blocksW * blocksH));
+
+  // Each tile handles the blocks whose top-left corner it contains, so every
+  // block is traced exactly once.
+  scheduler.run([&](const Tile& tile) {
+    std::unique_ptr<Sampler> sampler =
+      Sampler::create(opts.sampler, samplerSeed);
+    sampler->startIteration(nextSampleIndex, 1);
+    Image::TileBuffer buffer = img.startTile(tile);
+    int bx0 = (tile.x0 + scale - 1) / scale;
+    int by0 = (tile.y0 + scale - 1) / scale;
+    for (int by = by0; by * scale < tile.y1; ++by) {
+      for (int bx = bx0; bx * scale < tile.x1; ++bx) {
+        // Pick a uniformly-distributed position within the block (pixel
+        // centers are at integer coordinates).
+        int x0 = bx * scale;
+        int y0 = by * scale;
+        int blockW = min(scale, img.w - x0);
+        int blockH = min(scale, img.h - y0);
+        sampler->startPixelSample(x0, y0, 0);
+        Vec2 u = sampler->next2D();
+        float posX = float(x0) - 0.5f + u[0] * float(blockW);
+        float posY = float(y0) - 0.5f + u[1] * float(blockH);
+
+        Ray r = generateRayAt(*sampler, posX, posY);
+        Image::Features features;
+        Vec L = trace(*sampler, r, nullptr, nullptr, 0, &features);
+        blockColors[size_t(by * blocksW + bx)] = L;
+
+        // Keep the sample for the final image as well, unless it landed in
+        // the part of a block that reaches into another tile.
+        int x = math::clampAny(int(floorf(posX + 0.5f)), x0, x0 + blockW - 1);
+        int y = math::clampAny(int(floorf(posY + 0.5f)), y0, y0 + blockH - 1);
+        if (x < tile.x1 && y < tile.y1) {
+          img.setSample(buffer, x, y, posX, posY, L, features);
+        }
       }
     }
+
+    img.finishTile(buffer);
   });
 
-  // Process and write the output file at the end of this iteration.
+  nextSampleIndex++;
+
   img.commitSamples();
-  img.writeToEXR(name);
+  std::vector<ExrWriter::File> files;
+  files.emplace_back(name, img.previewSnapshot(scale, blockColors));
+  writer.submit(std::move(files));
 
-  // End timer.
   chrono::steady_clock::time_point endTime = chrono::steady_clock::now();
   chrono::duration<float> runTime =
     chrono::duration_cast<chrono::duration<float>>(endTime - startTime);
   std::cout << " [" << runTime.count() << " seconds]\n";
+  return runTime.count();
 }
 
 void Camera::renderMultiple(
   std::string name,
   int iterations
 ) {
-  if (iterations < 0) {
+  const bool timeLimited = opts.timeLimit > 0.0f;
+  const bool noiseLimited = opts.targetNoise > 0.0f;
+
+  // The previews count against the time limit too.
+  chrono::steady_clock::time_point deadline = chrono::steady_clock::now()
+    + chrono::duration_cast<chrono::steady_clock::duration>(
+        chrono::duration<float>(opts.timeLimit)
+      );
+  auto secondsLeft = [&]() {
+    return chrono::duration_cast<chrono::duration<float>>(
+      deadline - chrono::steady_clock::now()
+    ).count();
+  };
+
+  if (opts.progressive && iters == 0) {
+    // Quick, coarse passes so that there is something to look at early.
+    float lastPreviewSeconds = 0.0f;
+    for (int scale = PREVIEW_MAX_SCALE; scale > 1; scale /= 2) {
+      if (timeLimited && lastPreviewSeconds > 0.0f) {
+        // Each pass traces four times the rays of the one before, and must
+        // leave time for the first full iteration of one sample per pixel,
+        // which traces scale * scale times the rays of the pass.
+        float previewSeconds = 4.0f * lastPreviewSeconds;
+        float neededSeconds = previewSeconds * (1.0f + float(scale * scale));
+        if (neededSeconds > secondsLeft() * TIME_LIMIT_SAFETY_FACTOR) {
+          std::cout << "Skipping the remaining previews to stay within the "
+            "time limit\n";
+          break;
+        }
+      }
+      lastPreviewSeconds = renderPreview(name, scale);
+    }
+  }
+
+  if (iterations < 0 && !timeLimited && !noiseLimited) {
     // Run forever.
     std::cout << "Rendering infinitely, press Ctrl-c to terminate program\n";
 
     while (true) {
       renderOnce(name);
     }
-  } else {
-    // Run finite iterations.
+  }
+
+  if (iterations >= 0) {
     std::cout << "Rendering " << iterations << " iterations\n";
+  }
+  if (timeLimited) {
+    std::cout << "Rendering for at most " << opts.timeLimit << " seconds\n";
+  }
+  if (noiseLimited) {
+    std::cout << "Rendering until mean pixel error <= " << opts.targetNoise
+      << "\n";
+  }
 
-    for (int i = 0; i < iterations; ++i) {
-      renderOnce(name);
+  for (int i = 0; iterations < 0 || i < iterations; ++i) {
+    if (noiseLimited && iters > 0 && img.meanError() <= opts.targetNoise) {
+      std::cout << "Reached target noise (mean pixel error "
+        << img.meanError() << ")\n";
+      break;
+    }
+
+    if (timeLimited || noiseLimited) {
+      float remainingSeconds = math::VERY_BIG;
+      if (timeLimited) {
+        remainingSeconds = secondsLeft();
+      }
+
+      if (!planNextIteration(remainingSeconds)) {
+        std::cout << "Stopping: another iteration would not finish before "
+          "the time limit\n";
+        break;
+      }
+    }
+
+    renderOnce(name);
+  }
+
+  // Make sure that the final image is on disk.
+  if (lastWrittenIteration != iters) {
+    writeOutput(name);
+  }
+  writer.flush();
+}
+
+bool Camera::isWriteDue() const {
+  if (lastWrittenIteration == 0) {
+    return true;
+  }
+
+  // Write at iterations 1, 2, 4, 8, and so on.
+  if (opts.geometricWrites && (iters & (iters - 1)) != 0) {
+    return false;
+  }
+
+  float secondsSinceWrite = chrono::duration_cast<chrono::duration<float>>(
+    chrono::steady_clock::now() - lastWriteTime
+  ).count();
+  return secondsSinceWrite >= opts.writeInterval;
+}
+
+void Camera::writeOutput(const std::string& name) {
+  chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+
+  std::vector<ExrWriter::File> files;
+  files.emplace_back(name, img.snapshot());
+  if (opts.denoise) {
+    files.emplace_back(denoisedFileName(name), img.denoisedSnapshot());
+  }
+  writer.submit(std::move(files));
+
+  lastWrittenIteration = iters;
+  lastWriteTime = chrono::steady_clock::now();
+  lastSnapshotSeconds = chrono::duration_cast<chrono::duration<float>>(
+    lastWriteTime - startTime
+  ).count();
+}
+
+bool Camera::planNextIteration(float remainingSeconds) {
+  if (iters == 0) {
+    // No timings yet; start with the cheapest possible iteration so that an
+    // image is written as early as possible.
+    img.setSamplesPerPixel(1);
+    return true;
+  }
+
+  // Writing the final image may have to wait for the write before it, and
+  // then encode its own files, on top of the snapshot.
+  float finalWriteSeconds = 2.0f * writer.lastWriteSeconds();
+
+  float secondsPerSample = lastTraceSeconds / float(img.getSamplesPerPixel());
+  float budget = min(
+    float(TARGET_ITERATION_SECONDS),
+    remainingSeconds * TIME_LIMIT_SAFETY_FACTOR - finalWriteSeconds
+  ) - lastSnapshotSeconds;
+
+  if (budget < secondsPerSample) {
+    if (remainingSeconds < math::VERY_BIG) {
+      return false;
     }
+
+    // Only aiming for a cadence, so still take at least one sample.
+    budget = secondsPerSample;
   }
+
+  img.setSamplesPerPixel(
+    int(min(budget / secondsPerSample, float(Image::MAX_SAMPLES_PER_PIXEL)))
+  );
+  return true;
 }
 
 Vec Camera::trace(
-  Randomness& rng,
-  const Ray& r,
-  std::vector<RenderVertex>& sharedEyePath
+  Sampler& sampler,
+  Ray r,
+  const Intersection* firstIsect,
+  ShadowQueue* shadows,
+  size_t owner,
+  Image::Features* featuresOut
 ) const {
-  sharedEyePath.clear();
-  randomWalk(rng, r, Vec(1, 1, 1), sharedEyePath);
-
   Vec L(0, 0, 0);
+  Vec beta(1, 1, 1);
   bool didDirectIlluminate = false;
+  GuidedPath guidedPath;
 
-  for (const RenderVertex& vtx : sharedEyePath) {
-    const Material* mat = vtx.geom->mat;
-    const AreaLight* light = vtx.geom->light;
+  // Whether the BSDF sample continuing the path doubles as the BSDF strategy
+  // of direct lighting; if so, the PDF and origin of the last such sample.
+  const bool shareBsdfSample =
+    opts.integrator == IntegratorType::PATH_MIS && !opts.pathGuiding;
+  float scatterPdf = 0.0f;
+  Vec scatterOrigin(0, 0, 0);
+
+  for (int depth = 0; ; ++depth) {
+    // Bounce ray and kill if nothing hit.
+    Intersection isect;
+    if (depth == 0 && firstIsect) {
+      isect = *firstIsect;
+    } else if (!accel.intersect(r, &isect)) {
+      // End path in empty space.
+      break;
+    }
+
+    const Material* mat = isect.geom->mat;
+    const AreaLight* light = isect.geom->light;
+
+    if (depth == 0 && featuresOut) {
+      featuresOut->albedo = mat ? mat->reflectance() : Vec(0, 0, 0);
+      featuresOut->normal = isect.normal;
+      featuresOut->position = isect.position;
+      featuresOut->depth = isect.distance;
+    }
 
     // Check for lighting.
     if (light && !didDirectIlluminate) {
       // Accumulate emission normally if we did not direct-illuminate at the
       // last vertex. For any _n_, we can only count one _n_-length path per
       // sample trace.
-      L += vtx.beta.cwiseProduct(light->emit(vtx));
+      Vec emitted = beta.cwiseProduct(light->emit(isect));
+      L += emitted;
+      guidedPath.addRadiance(emitted);
+    } else if (light && shareBsdfSample) {
+      // The last vertex's direct lighting only sampled the light, so this is
+      // its BSDF-sampled counterpart; weight it against light sampling.
+      float lightPdf = lightTree.pdf(scatterOrigin, isect.geom)
+        * isect.geom->samplePointPDF(scatterOrigin, isect);
+      float bsdfWeight = math::powerHeuristic(1, scatterPdf, 1, lightPdf);
+      L += beta.cwiseProduct(light->emit(isect)) * bsdfWeight;
     }
 
     // Direct-illuminate if possible.
     if (mat && mat->shouldDirectIlluminate()) {
 #ifndef NO_DIRECT_ILLUM
       // Sample direct lighting and then continue path.
-      L += vtx.beta.cwiseProduct(
-        uniformSampleOneLight(rng, vtx)
-      );
+      sampler.startLighting(depth);
+      if (shadows) {
+        queueOneLight(sampler, isect, beta, owner, shadows, !shareBsdfSample);
+      } else {
+        Vec direct =
+          beta.cwiseProduct(sampleOneLight(sampler, isect, !shareBsdfSample));
+        L += direct;
+        guidedPath.addRadiance(direct);
+      }
       didDirectIlluminate = true;
 #else
       didDirectIlluminate = false;
@@ -180,79 +537,127 @@ Vec Camera::trace(
     } else {
       didDirectIlluminate = false;
     }
-  }
-
-  L[0] = math::clamp(L[0], 0.0f, BIASED_RADIANCE_CLAMPING);
-  L[1] = math::clamp(L[1], 0.0f, BIASED_RADIANCE_CLAMPING);
-  L[2] = math::clamp(L[2], 0.0f, BIASED_RADIANCE_CLAMPING);
-
-  return L;
-}
-
-void Camera::randomWalk(
-  Randomness& rng,
-  Ray r,
-  Vec beta,
-  std::vector<RenderVertex>& path
-) const {
-  for (int depth = 0; ; ++depth) {
-    // Bounce ray and kill if nothing hit.
-    RenderVertex isect(beta);
-    if (accel.intersect(r, &isect)) {
-      path.push_back(isect);
-    } else {
-      // End path in empty space.
-      break;
-    }
 
     // Check for scattering (reflection/transmission).
-    if (isect.geom->mat) {
-      isect.geom->mat->scatter(rng, isect, &r, &beta);
-    } else {
+    sampler.startScattering(depth);
+    if (!mat) {
       // Cannot continue path without a material.
       break;
+    } else if (opts.pathGuiding && mat->shouldDirectIlluminate()) {
+      // Only non-specular materials are guided.
+      int leaf = guide.lookup(isect.position);
+      float pdf;
+      guide.scatter(sampler, isect, leaf, &r, &beta, &pdf);
+      guidedPath.addVertex(leaf, r.direction, beta, pdf);
+    } else {
+      mat->scatter(sampler, isect, &r, &beta, &scatterPdf);
+      scatterOrigin = isect.position;
     }
 
     // Do Russian Roulette if this path is "old".
-    if (depth >= RUSSIAN_ROULETTE_DEPTH_1 || math::isNearlyZero(beta)) {
-      float rv = rng.nextUnitFloat();
+    if (!russianRoulette(sampler, depth, &beta)) {
+      break;
+    }
+  }
 
-      float probLive;
-      if (depth >= RUSSIAN_ROULETTE_DEPTH_2) {
-        // More aggressive ray killing when ray is very old.
-        probLive = math::clampedLerp(0.25f, 0.75f, math::luminance(beta));
-      } else {
-        // Less aggressive ray killing.
-        probLive = math::clampedLerp(0.25f, 1.00f, math::luminance(beta));
-      }
+  if (opts.pathGuiding) {
+    guidedPath.commit(guide);
+  }
 
-      if (rv < probLive) {
-        // The ray lives (more energy = more likely to live).
-        // Increase its energy to balance out probabilities.
-        beta = beta / probLive;
-      } else {
-        // The ray dies.
-        break;
-      }
-    }
+  return clampRadiance(L);
+}
+
+std::string Camera::denoisedFileName(const std::string& name) {
+  const std::string extension = ".exr";
+  if (name.size() >= extension.size()
+      && name.compare(name.size() - extension.size(), extension.size(),
+                      extension) == 0) {
+    return name.substr(0, name.size() - extension.size()) + ".denoised"
+      + extension;
   }
+
+  return name + ".denoised";
 }
 
-Vec Camera::uniformSampleOneLight(
-  Randomness& rng,
-  const Intersection& isect
+Vec Camera::clampRadiance(const Vec& L) {
+  return Vec(
+    math::clamp(L[0], 0.0f, BIASED_RADIANCE_CLAMPING),
+    math::clamp(L[1], 0.0f, BIASED_RADIANCE_CLAMPING),
+    math::clamp(L[2], 0.0f, BIASED_RADIANCE_CLAMPING)
+  );
+}
+
+bool Camera::russianRoulette(
+  Sampler& sampler,
+  int depth,
+  Vec* betaInOut
 ) const {
-  size_t numLights = emitters.size();
-  if (numLights == 0) {
+  if (depth < RUSSIAN_ROULETTE_DEPTH_1 && !math::isNearlyZero(*betaInOut)) {
+    return true;
+  }
+
+  float rv = sampler.next1D();
+
+  float probLive;
+  if (depth >= RUSSIAN_ROULETTE_DEPTH_2) {
+    // More aggressive ray killing when ray is very old.
+    probLive = math::clampedLerp(0.25f, 0.75f, math::luminance(*betaInOut));
+  } else {
+    // Less aggressive ray killing.
+    probLive = math::clampedLerp(0.25f, 1.00f, math::luminance(*betaInOut));
+  }
+
+  if (rv < probLive) {
+    // The ray lives (more energy = more likely to live).
+    // Increase its energy to balance out probabilities.
+    *betaInOut = *betaInOut / probLive;
+    return true;
+  }
+
+  // The ray dies.
+  return false;
+}
+
+Vec Camera::sampleOneLight(
+  Sampler& sampler,
+  const Intersection& isect,
+  bool sampleMat
+) const {
+  size_t lightIdx;
+  float lightPdf;
+  if (!lightTree.sample(sampler, isect.position, &lightIdx, &lightPdf)
+      || lightPdf <= 0.0f) {
     return Vec(0, 0, 0);
   }
 
-  size_t lightIdx = size_t(floorf(rng.nextUnitFloat() * numLights));
-  const Geom* emitter = emitters[min(lightIdx, numLights - 1)];
+  const Geom* emitter = emitters[lightIdx];
+  const AreaLight* areaLight = emitter->light;
+
+  return areaLight->directIlluminate(
+    sampler, isect, emitter, &accel, sampleMat, lightPdf
+  ) / lightPdf;
+}
+
+void Camera::queueOneLight(
+  Sampler& sampler,
+  const Intersection& isect,
+  const Vec& beta,
+  size_t owner,
+  ShadowQueue* queue,
+  bool sampleMat
+) const {
+  size_t lightIdx;
+  float lightPdf;
+  if (!lightTree.sample(sampler, isect.position, &lightIdx, &lightPdf)
+      || lightPdf <= 0.0f) {
+    return;
+  }
+
+  const Geom* emitter = emitters[lightIdx];
   const AreaLight* areaLight = emitter->light;
 
-  // P[this light] = 1 / numLights, so 1 / P[this light] = numLights.
-  return float(numLights) * areaLight->directIlluminate(
-    rng, isect, emitter, &accel
+  areaLight->directIlluminateDeferred(
+    sampler, isect, emitter, beta / lightPdf, owner, queue, sampleMat,
+    lightPdf
   );
 }
@@ -4,12 +4,22 @@
 #include "image.h"
 #include "node.h"
 #include "embree.h"
+#include "tiles.h"
+#include "options.h"
+#include "sampler.h"
+#include "guiding.h"
+#include "lightbvh.h"
+#include "shadowqueue.h"
+#include "exrwriter.h"
+#include <chrono>
 #include <vector>
 
 /**
  * Manages rendering by simulating the action of a physical pinhole camera.
  */
 class Camera {
+  friend class WavefrontIntegrator;
+
   /**
    * The number of bounces at which a ray is subject to Russian Roulette
    * termination, stage 1 (less aggressive).
@@ -20,10 +30,6 @@ class Camera {
    * termination, stage 2 (more aggressive).
    */
   static constexpr int RUSSIAN_ROULETTE_DEPTH_2 = 50;
-  /**
-   * The amount of memory to initially allocate for each path.
-   */
-  static constexpr int INITIAL_PATH_LENGTH = 50;
   /**
    * Limits any given sample to the given amount of radiance. This helps to
    * reduce "fireflies" in the output. The lower this value, the more bias will
@@ -31,10 +37,38 @@ class Camera {
    * std::numeric_limits<float>::max().
    */
   static constexpr float BIASED_RADIANCE_CLAMPING = 50.0f;
+  /**
+   * The length, in seconds, that each iteration should take when the number
+   * of samples per iteration is adapted (i.e. when rendering to a time limit
+   * or a noise target).
+   */
+  static constexpr float TARGET_ITERATION_SECONDS = 10.0f;
+  /**
+   * The fraction of the remaining time that an iteration may be planned to
+   * use when rendering to a time limit, leaving headroom for timing jitter.
+   */
+  static constexpr float TIME_LIMIT_SAFETY_FACTOR = 0.8f;
+  /**
+   * The downsampling factor of the first (coarsest) progressive preview
+   * pass. Each following preview pass halves it until full resolution.
+   */
+  static constexpr int PREVIEW_MAX_SCALE = 8;
 
   Embree accel; /**< The accelerator containing renderable geometry. */
   std::vector<const Geom*> emitters; /**< List of all light emitters. */
 
+  /**
+   * Picks emitters for direct illumination based on their power, distance,
+   * and orientation relative to the point being illuminated.
+   */
+  LightBVH lightTree;
+
+  /**
+   * The learned radiance distribution for path guiding. Paths record into it
+   * (thread-safely) while they are traced.
+   */
+  mutable GuidingTree guide;
+
   const float focalLength; /**< The distance from the eye to the focal plane. */
   const float lensRadius; /**< The radius of the lens opening. */
   const Transform camToWorldXform; /**< Transform from camera to world space. */
@@ -43,56 +77,206 @@ class Camera {
   float focalPlaneRight; /**< The width of the focal plane. */
   Vec focalPlaneOrigin; /**< The origin (corner) of the focal plane. */
 
-  Randomness masterRng; /**< The RNG used to seed the per-row RNGs. */
-  std::vector<unsigned> rowSeeds; /**< The per-row RNG seeds. */
+  /**
+   * The seed of the render's sample sequences and random streams. Every
+   * sample is a function of it and the sample's pixel, index, and dimension.
+   */
+  unsigned samplerSeed;
+  unsigned nextSampleIndex; /**< The sequence index of the next iteration. */
 
   Image img; /**< The rendered and filtered image. */
+  TileScheduler scheduler; /**< Splits the image into parallel tiles. */
 
   int iters; /** The current number of path-tracing iterations done. */
 
+  RenderOptions opts; /**< The settings used for rendering. */
+
+  float lastTraceSeconds; /**< Time to trace and commit the last iteration. */
   /**
-   * Traces a path starting with the given ray, and returns the sampled
-   * radiance.
+   * Time to snapshot (and denoise) the image, the last time it was written.
+   */
+  float lastSnapshotSeconds;
+
+  /** Writes the output files in the background while rendering goes on. */
+  ExrWriter writer;
+  /** The iteration whose image was last written (0 if none). */
+  int lastWrittenIteration;
+  /** When the image was last handed to the writer. */
+  std::chrono::steady_clock::time_point lastWriteTime;
+
+  /**
+   * Whether the image of the iteration that just finished should be written,
+   * according to the write interval and schedule in the options. The first
+   * iteration is always written.
+   */
+  bool isWriteDue() const;
+
+  /**
+   * Snapshots the image (and the denoised image, if requested) and hands
+   * them to the background writer.
    *
-   * @param rng                the per-thread RNG in use
-   * @param r                  the ray that starts the path
-   * @param sharedEyePath [in] a shared structure used to store the eye path
-   *                           while tracing the sample
-   * @returns                  the sampled radiance of the path
+   * @param name the name of the output EXR file
    */
-   Vec trace(
-     Randomness& rng,
-     const Ray& r,
-     std::vector<RenderVertex>& sharedEyePath
-   ) const;
+  void writeOutput(const std::string& name);
+
+  /**
+   * Picks the number of samples per pixel for the next iteration so that it
+   * takes about TARGET_ITERATION_SECONDS, based on the timings of the last
+   * iteration, and applies it to the image. With a deadline, the iteration
+   * must also leave time to write the final image: to snapshot it, to wait
+   * for the write already in progress, and to encode it.
+   *
+   * @param remainingSeconds the time left before the deadline, or
+   *                         math::VERY_BIG if there is no deadline
+   * @returns                false if not even one sample per pixel (plus
+   *                         writing the image) fits in the remaining time
+   */
+  bool planNextIteration(float remainingSeconds);
+
+  /**
+   * Picks a jittered position within the filter footprint of a pixel and
+   * generates a camera ray through it, sampling the lens for depth of field.
+   * The sampler must be at the start of the pixel sample.
+   *
+   * @param sampler    the per-thread sampler in use
+   * @param x          the x-coordinate of the pixel
+   * @param y          the y-coordinate of the pixel
+   * @param posX [out] the x-position of the sample on the image plane
+   * @param posY [out] the y-position of the sample on the image plane
+   * @returns          the world-space camera ray for the sample
+   */
+  Ray generateRay(
+    Sampler& sampler,
+    int x,
+    int y,
+    float* posX,
+    float* posY
+  ) const;
 
   /**
-   * Constructs a path by randomly walking the scene from the given initial ray.
+   * Generates a camera ray through the given position on the image plane,
+   * sampling the lens for depth of field.
    *
-   * @param rng           the per-thread RNG in use
-   * @param r             the ray that starts the path
-   * @param beta          the throughput at the initial point in the path
-   * @param path [in,out] a shared structure used to store the constructed path
+   * @param sampler the per-thread sampler in use
+   * @param posX    the x-position on the image plane, in pixels
+   * @param posY    the y-position on the image plane, in pixels
+   * @returns       the world-space camera ray
    */
-  void randomWalk(
-    Randomness& rng,
+  Ray generateRayAt(Sampler& sampler, float posX, float posY) const;
+
+  /**
+   * Renders a quick preview pass with one sample per block of scale x scale
+   * pixels, and writes it upsampled to the output file. The samples are also
+   * added to the image, so they contribute to the final render.
+   *
+   * @param name  the name of the output EXR file
+   * @param scale the width and height of each block, in pixels
+   * @returns     the time that the pass took, in seconds
+   */
+  float renderPreview(std::string name, int scale);
+
+  /**
+   * Applies Russian Roulette termination to a path once it is old or its
+   * throughput is nearly zero. Surviving paths have their throughput scaled
+   * up to balance out the probability of termination.
+   *
+   * @param sampler            the per-thread sampler in use
+   * @param depth              the number of bounces so far
+   * @param betaInOut [in,out] the throughput of the path
+   * @returns                  true if the path lives, false if it dies
+   */
+  bool russianRoulette(Sampler& sampler, int depth, Vec* betaInOut) const;
+
+  /**
+   * Clamps the radiance of a sample to [0, BIASED_RADIANCE_CLAMPING].
+   */
+  static Vec clampRadiance(const Vec& L);
+
+  /**
+   * Returns the name of the denoised output file for the given output file,
+   * e.g. "out.denoised.exr" for "out.exr".
+   */
+  static std::string denoisedFileName(const std::string& name);
+
+  /**
+   * Traces a path starting with the given ray, and returns the sampled
+   * radiance. Emission and direct lighting are accumulated at each vertex
+   * as the path is walked, so no vertices need to be stored. The sampler
+   * must be on the path's pixel sample; each bounce moves it to that
+   * bounce's dimensions.
+   *
+   * If a shadow queue is given, then the direct lighting is not tested for
+   * occlusion right away; its shadow rays are queued instead, and the caller
+   * must flush the queue and add the resulting radiance (and clamp the sum).
+   * This can't be used with path guiding, which needs the radiance of the
+   * whole path when the path ends.
+   *
+   * With the PATH_MIS integrator, the BSDF sample that continues the path is
+   * also the BSDF-sampling strategy of the last vertex's direct lighting, so
+   * emission that it hits is MIS-weighted instead of skipped. (Path guiding
+   * samples a mixture that the light strategy's weights don't account for,
+   * so it turns this off.)
+   *
+   * @param sampler           the per-thread sampler in use
+   * @param r                 the ray that starts the path
+   * @param firstIsect        if not null, the already-computed intersection
+   *                          of r with the scene, e.g. from a ray packet
+   * @param shadows           if not null, the queue for the direct-lighting
+   *                          shadow rays
+   * @param owner             the index that identifies the path in the
+   *                          shadow queue
+   * @param featuresOut [out] if not null, receives the surface at the first
+   *                          hit (left unchanged if the path hits nothing)
+   * @returns                 the sampled radiance of the path (without the
+   *                          queued direct lighting)
+   */
+  Vec trace(
+    Sampler& sampler,
     Ray r,
-    Vec beta,
-    std::vector<RenderVertex>& path
+    const Intersection* firstIsect = nullptr,
+    ShadowQueue* shadows = nullptr,
+    size_t owner = 0,
+    Image::Features* featuresOut = nullptr
   ) const;
 
   /**
-   * Randomly picks a light and samples it for direct illumination. The
-   * radiance returned will be scaled according to the probability of picking
-   * the light.
+   * Randomly picks a light from the light BVH, favoring lights that are
+   * bright, close, and facing the intersection, and samples it for direct
+   * illumination. The radiance returned will be scaled according to the
+   * probability of picking the light.
    *
-   * @param rng         the per-thread RNG in use
+   * @param sampler     the per-thread sampler in use
    * @param isect       the intersection on the target geometry that should be
    *                    illuminated
+   * @param sampleMat   whether the light's MIS also samples the material, or
+   *                    relies on the path's own BSDF sample (see
+   *                    AreaLight::directIlluminate)
    */
-  Vec uniformSampleOneLight(
-    Randomness& rng,
-    const Intersection& isect
+  Vec sampleOneLight(
+    Sampler& sampler,
+    const Intersection& isect,
+    bool sampleMat = true
+  ) const;
+
+  /**
+   * Like Camera::sampleOneLight, but queues the shadow rays for the light
+   * instead of testing them right away.
+   *
+   * @param sampler     the per-thread sampler in use
+   * @param isect       the intersection on the target geometry that should be
+   *                    illuminated
+   * @param beta        the throughput of the path
+   * @param owner       the index that identifies the path in the queue
+   * @param queue       the queue that receives the shadow rays
+   * @param sampleMat   whether the light's MIS also samples the material
+   */
+  void queueOneLight(
+    Sampler& sampler,
+    const Intersection& isect,
+    const Vec& beta,
+    size_t owner,
+    ShadowQueue* queue,
+    bool sampleMat = true
   ) const;
 
 public:
@@ -123,6 +307,11 @@ public:
    */
    Camera(const Node& n);
 
+  /**
+   * Sets the options used for subsequent rendering.
+   */
+  void setOptions(const RenderOptions& o);
+
   /**
    * Renders an additional iteration of the image by path-tracing.
    * If there are existing iterations, the additional iteration will be
@@ -138,9 +327,22 @@ public:
    * Renders multiple additional path-tracing iterations.
    * To render infinite iterations, specify iterations = -1.
    *
+   * If the options set a time limit or a noise target, then rendering also
+   * stops once the next iteration would not finish (and write its image)
+   * before the deadline, or once the mean pixel error reaches the target. In
+   * these modes, the samples per pixel of each iteration are adapted so that
+   * iterations finish at a steady cadence.
+   *
+   * If the options enable path guiding, then the guiding tree is trained on
+   * the paths of every iteration and used from the next iteration on.
+   *
+   * If the options enable progressive rendering, then coarse preview passes
+   * at 1/8, 1/4, and 1/2 resolution are rendered and written first.
+   *
    * @param name       the name of the output EXR file
    * @param iterations the number of iterations to render; if < 0, then this
-   *                   function will run forever
+   *                   function will run until another limit is reached (or
+   *                   forever if there is none)
    */
   void renderMultiple(
     std::string name,
@@ -186,6 +186,47 @@ struct BSphere {
   }
 };
 
+/**
+ * A cone of directions around a central axis. Used to bound the normals of a
+ * surface, e.g. when deciding whether a light can face a point.
+ */
+struct NormalCone {
+  Vec axis; /**< The central direction of the cone; must be normalized. */
+  float theta; /**< The half-angle of the cone, in [0, pi]. */
+
+  /** Constructs a cone containing every direction. */
+  NormalCone() : axis(0, 0, 1), theta(math::PI) {}
+
+  NormalCone(const Vec& a, float t = 0.0f) : axis(a), theta(t) {}
+
+  /**
+   * Expands the cone to also contain another given cone. The result is the
+   * smallest cone containing both. See Pharr, Jakob, and Humphreys,
+   * Physically Based Rendering, 4th ed., section 3.8.4.
+   */
+  inline void expand(const NormalCone& c) {
+    float thetaD = acosf(math::clamp(axis.dot(c.axis), -1.0f, 1.0f));
+    if (min(thetaD + c.theta, math::PI) <= theta) {
+      return;
+    }
+    if (min(thetaD + theta, math::PI) <= c.theta) {
+      *this = c;
+      return;
+    }
+
+    float thetaO = 0.5f * (theta + thetaD + c.theta);
+    Vec rotAxis = axis.cross(c.axis);
+    if (thetaO >= math::PI || math::isNearlyZero(rotAxis)) {
+      *this = NormalCone();
+      return;
+    }
+
+    // Rotate toward the other axis so that the new cone touches both edges.
+    axis = Eigen::AngleAxisf(thetaO - theta, rotAxis.normalized()) * axis;
+    theta = thetaO;
+  }
+};
+
 /**
  * Contains the information for a ray-object intersection.
  */
@@ -215,16 +256,3 @@ struct Intersection {
     : position(p), normal(n), incomingRay(r), geom(g), distance(d) {}
 
 };
-
-/**
- * Contains the information for a point along a rendering path.
- */
-struct RenderVertex : public Intersection {
-  Vec beta; /**< The transmission throughput (e.g. of radiance). */
-
-  /**
-   * Creates an empty render vertex with the specified beta value.
-   * @param b the beta (transmission throughput)
-   */
-  RenderVertex(const Vec& b) : Intersection(), beta(b) {}
-};
@@ -0,0 +1,110 @@
+#include "denoiser.h"
+#include "parallel.h"
+
+Denoiser::Denoiser(int ww, int hh) : w(ww), h(hh) {}
+
+void Denoiser::denoise(
+  const std::vector<Vec>& color,
+  const std::vector<float>& variance,
+  const std::vector<Image::Features>& features,
+  std::vector<Vec>* colorOut
+) const {
+  // Averaging normals over a pixel shortens them at edges; only their
+  // direction matters to the filter.
+  std::vector<Image::Features> normalized(features);
+  for (Image::Features& f : normalized) {
+    float len = f.normal.norm();
+    if (len > 0.0f) {
+      f.normal /= len;
+    }
+  }
+
+  std::vector<Vec> colorA(color);
+  std::vector<float> varianceA(variance);
+  std::vector<Vec> colorB(color.size());
+  std::vector<float> varianceB(variance.size());
+
+  for (int i = 0; i < PASSES; ++i) {
+    pass(1 << i, normalized, colorA, varianceA, &colorB, &varianceB);
+    colorA.swap(colorB);
+    varianceA.swap(varianceB);
+  }
+
+  colorOut->swap(colorA);
+}
+
+void Denoiser::pass(
+  int step,
+  const std::vector<Image::Features>& features,
+  const std::vector<Vec>& colorIn,
+  const std::vector<float>& varianceIn,
+  std::vector<Vec>* colorOut,
+  std::vector<float>* varianceOut
+) const {
+  // The 1D B3-spline kernel; the 2D kernel is its outer product.
+  static const float kernel[5] = {
+    1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f
+  };
+
+  parallel::parallel_for(0, h, [&](int y) {
+    for (int x = 0; x < w; ++x) {
+      size_t p = size_t(y * w + x);
+      const Image::Features& fp = features[p];
+      const Vec& cp = colorIn[p];
+      float lp = math::luminance(cp);
+      float sigmaL =
+        SIGMA_LUMINANCE * sqrtf(max(varianceIn[p], 0.0f)) + math::VERY_SMALL;
+      bool missP = fp.normal.isZero();
+
+      Vec sumColor(0, 0, 0);
+      float sumVariance = 0.0f;
+      float sumWeight = 0.0f;
+
+      for (int j = -2; j <= 2; ++j) {
+        int yy = y + j * step;
+        if (yy < 0 || yy >= h) {
+          continue;
+        }
+
+        for (int i = -2; i <= 2; ++i) {
+          int xx = x + i * step;
+          if (xx < 0 || xx >= w) {
+            continue;
+          }
+
+          size_t q = size_t(yy * w + xx);
+          const Image::Features& fq = features[q];
+          const Vec& cq = colorIn[q];
+
+          // Pixels that hit nothing only blend with each other.
+          bool missQ = fq.normal.isZero();
+          if (missP != missQ) {
+            continue;
+          }
+
+          float weight = kernel[i + 2] * kernel[j + 2];
+          if (!missP) {
+            float cosNormals = max(0.0f, fp.normal.dot(fq.normal));
+            float dist = float(step) * sqrtf(float(i * i + j * j));
+            float depthScale =
+              SIGMA_DEPTH * max(fp.depth, fq.depth) * dist + math::VERY_SMALL;
+            float albedoDist2 = (fp.albedo - fq.albedo).squaredNorm();
+
+            weight *= powf(cosNormals, NORMAL_EXPONENT)
+              * expf(-fabsf(fp.depth - fq.depth) / depthScale)
+              * expf(-albedoDist2 / (SIGMA_ALBEDO * SIGMA_ALBEDO));
+          }
+          weight *= expf(-fabsf(lp - math::luminance(cq)) / sigmaL);
+
+          sumColor += cq * weight;
+          sumVariance += weight * weight * varianceIn[q];
+          sumWeight += weight;
+        }
+      }
+
+      // The center tap always has full feature weight, so sumWeight > 0.
+      (*colorOut)[p] = sumColor / sumWeight;
+      (*varianceOut)[p] = sumVariance / (sumWeight * sumWeight);
+    }
+  });
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "core.h"
+#include "image.h"
+#include <vector>
+
+/**
+ * An edge-avoiding a-trous wavelet filter that removes Monte Carlo noise
+ * from a rendered image. Each pass blurs the image with a 5x5 B3-spline
+ * kernel whose taps are spread twice as far apart as in the pass before,
+ * so that a few passes cover a wide footprint. Each tap is weighted down
+ * where the pixels differ in their first-hit features (albedo, normal, and
+ * depth), so edges and textures are kept, and where their colors differ by
+ * more than the pixel's own noise explains.
+ *
+ * See Dammertz et al., "Edge-Avoiding A-Trous Wavelet Transform for Fast
+ * Global Illumination Filtering" (2010), and for the variance-guided color
+ * weights, Schied et al., "Spatiotemporal Variance-Guided Filtering" (2017).
+ */
+class Denoiser {
+  /** The number of filter passes; the widest one has a step of 16 pixels. */
+  static constexpr int PASSES = 5;
+  /** How many standard deviations of noise a luminance difference may be. */
+  static constexpr float SIGMA_LUMINANCE = 4.0f;
+  /** The exponent applied to the cosine between normals. */
+  static constexpr float NORMAL_EXPONENT = 32.0f;
+  /** The tolerated relative depth difference per pixel of distance. */
+  static constexpr float SIGMA_DEPTH = 0.05f;
+  /** The tolerated difference in albedo. */
+  static constexpr float SIGMA_ALBEDO = 0.1f;
+
+  const int w; /**< The width of the image. */
+  const int h; /**< The height of the image. */
+
+  /**
+   * Runs one filter pass over the whole image in parallel.
+   *
+   * @param step              the distance between the kernel's taps, in
+   *                          pixels
+   * @param features          the (normalized) features of each pixel
+   * @param colorIn           the colors from the previous pass
+   * @param varianceIn        the luminance variances from the previous pass
+   * @param colorOut    [out] the filtered colors
+   * @param varianceOut [out] the variances of the filtered luminances
+   */
+  void pass(
+    int step,
+    const std::vector<Image::Features>& features,
+    const std::vector<Vec>& colorIn,
+    const std::vector<float>& varianceIn,
+    std::vector<Vec>* colorOut,
+    std::vector<float>* varianceOut
+  ) const;
+
+public:
+  /**
+   * Constructs a denoiser for images of the given size.
+   */
+  Denoiser(int ww, int hh);
+
+  /**
+   * Denoises an image. All inputs are in row-major order.
+   *
+   * @param color          the noisy colors
+   * @param variance       the variance of each pixel's mean luminance
+   * @param features       the mean first-hit features of each pixel
+   * @param colorOut [out] the denoised colors
+   */
+  void denoise(
+    const std::vector<Vec>& color,
+    const std::vector<float>& variance,
+    const std::vector<Image::Features>& features,
+    std::vector<Vec>* colorOut
+  ) const;
+};
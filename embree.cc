@@ -7,13 +7,22 @@
 #include <pmmintrin.h>
 #endif
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 bool Embree::embreeInited = false;
 RTCDevice Embree::device = nullptr;
+int Embree::packetSize = 4;
 
 Embree::Embree(const std::vector<const Geom*>& o)
   : embreeObjStorage(o.size()), embreeObjLookup() {
   assert(embreeInited);
-  scene = rtcDeviceNewScene(device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+  scene = rtcDeviceNewScene(
+    device,
+    RTC_SCENE_STATIC,
+    RTC_INTERSECT1 | RTC_INTERSECT_STREAM | packetAlgorithmFlags()
+  );
 
   size_t i = 0;
   for (const Geom* g : o) {
@@ -35,16 +44,85 @@ void Embree::init() {
 #endif
 
   device = rtcNewDevice(nullptr);
+  packetSize = detectPacketSize();
   embreeInited = true;
 }
 
+int Embree::detectPacketSize() {
+  int cpuPacketSize = detectCpuPacketSize();
+
+  // Embree can be built without the AVX or AVX-512 kernels, in which case
+  // the wider packet queries fail even though the CPU supports them.
+  if (cpuPacketSize >= 16
+      && rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT16) != 0) {
+    return 16;
+  } else if (cpuPacketSize >= 8
+      && rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT8) != 0) {
+    return 8;
+  }
+  return 4;
+}
+
+int Embree::detectCpuPacketSize() {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  int maxLeaf = info[0];
+
+  __cpuid(info, 1);
+  bool osSavesYmm = false;
+  bool osSavesZmm = false;
+  if (info[2] & (1 << 27)) {
+    // OSXSAVE: check that the OS saves the AVX (and AVX-512) registers.
+    unsigned long long xcr0 = _xgetbv(0);
+    osSavesYmm = (xcr0 & 0x6) == 0x6;
+    osSavesZmm = (xcr0 & 0xe6) == 0xe6;
+  }
+  bool avx = (info[2] & (1 << 28)) && osSavesYmm;
+
+  bool avx512 = false;
+  if (maxLeaf >= 7) {
+    __cpuidex(info, 7, 0);
+    avx512 = (info[1] & (1 << 16)) && osSavesZmm;
+  }
+
+  if (avx512) {
+    return 16;
+  } else if (avx) {
+    return 8;
+  }
+  return 4;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return 16;
+  } else if (__builtin_cpu_supports("avx")) {
+    return 8;
+  }
+  return 4;
+#else
+  return 4;
+#endif
+}
+
+int Embree::packetAlgorithmFlags() {
+  switch (packetSize) {
+    case 16:
+      return RTC_INTERSECT16;
+    case 8:
+      return RTC_INTERSECT8;
+    default:
+      return RTC_INTERSECT4;
+  }
+}
+
 void Embree::exit() {
   rtcDeleteDevice(device);
   embreeInited = false;
 }
 
-bool Embree::intersect(const Ray& r, Intersection* isectOut) const {
-  RTCRay ray;
+void Embree::makeRTCRay(const Ray& r, float maxDist, RTCRay* rayOut) {
+  RTCRay& ray = *rayOut;
   ray.org[0] = r.origin.x();
   ray.org[1] = r.origin.y();
   ray.org[2] = r.origin.z();
@@ -52,12 +130,17 @@ bool Embree::intersect(const Ray& r, Intersection* isectOut) const {
   ray.dir[1] = r.direction.y();
   ray.dir[2] = r.direction.z();
   ray.tnear = 0.0f;
-  ray.tfar = math::VERY_BIG;
+  ray.tfar = maxDist;
   ray.geomID = int(RTC_INVALID_GEOMETRY_ID);
   ray.primID = int(RTC_INVALID_GEOMETRY_ID);
   ray.instID = int(RTC_INVALID_GEOMETRY_ID);
   ray.mask = int(0xFFFFFFFF);
   ray.time = 0.0f;
+}
+
+bool Embree::intersect(const Ray& r, Intersection* isectOut) const {
+  RTCRay ray;
+  makeRTCRay(r, math::VERY_BIG, &ray);
   rtcIntersect(scene, ray);
 
   if (ray.geomID != int(RTC_INVALID_GEOMETRY_ID)) {
@@ -71,20 +154,162 @@ bool Embree::intersect(const Ray& r, Intersection* isectOut) const {
 
 bool Embree::intersectShadow(const Ray& r, float maxDist) const {
   RTCRay ray;
-  ray.org[0] = r.origin.x();
-  ray.org[1] = r.origin.y();
-  ray.org[2] = r.origin.z();
-  ray.dir[0] = r.direction.x();
-  ray.dir[1] = r.direction.y();
-  ray.dir[2] = r.direction.z();
-  ray.tnear = 0.0f;
-  ray.tfar = maxDist;
-  ray.geomID = int(RTC_INVALID_GEOMETRY_ID);
-  ray.primID = int(RTC_INVALID_GEOMETRY_ID);
-  ray.instID = int(RTC_INVALID_GEOMETRY_ID);
-  ray.mask = int(0xFFFFFFFF);
-  ray.time = 0.0f;
+  makeRTCRay(r, maxDist, &ray);
   rtcOccluded(scene, ray);
 
   return ray.geomID == 0;
 }
+
+size_t Embree::intersectMany(
+  const Ray* rays,
+  size_t count,
+  RayHit* hitsOut
+) const {
+  RTCIntersectContext context;
+  context.flags = RTC_INTERSECT_INCOHERENT;
+  context.userRayExt = nullptr;
+
+  RTCRay stream[STREAM_CHUNK_SIZE];
+  size_t numHits = 0;
+
+  for (size_t start = 0; start < count; start += STREAM_CHUNK_SIZE) {
+    size_t chunk = min(count - start, size_t(STREAM_CHUNK_SIZE));
+    for (size_t i = 0; i < chunk; ++i) {
+      makeRTCRay(rays[start + i], math::VERY_BIG, &stream[i]);
+    }
+
+    rtcIntersect1M(scene, &context, stream, chunk, sizeof(RTCRay));
+
+    for (size_t i = 0; i < chunk; ++i) {
+      const RTCRay& ray = stream[i];
+      if (ray.geomID != int(RTC_INVALID_GEOMETRY_ID)) {
+        RayHit& hit = hitsOut[numHits];
+        const EmbreeObj* eo = embreeObjLookup.at(unsigned(ray.geomID));
+        eo->isectCallback(eo, ray, &hit.isect);
+        hit.index = start + i;
+        numHits++;
+      }
+    }
+  }
+
+  return numHits;
+}
+
+void Embree::occludedMany(
+  const Ray* rays,
+  const float* maxDists,
+  size_t count,
+  bool* occludedOut
+) const {
+  RTCIntersectContext context;
+  context.flags = RTC_INTERSECT_INCOHERENT;
+  context.userRayExt = nullptr;
+
+  RTCRay stream[STREAM_CHUNK_SIZE];
+
+  for (size_t start = 0; start < count; start += STREAM_CHUNK_SIZE) {
+    size_t chunk = min(count - start, size_t(STREAM_CHUNK_SIZE));
+    for (size_t i = 0; i < chunk; ++i) {
+      makeRTCRay(rays[start + i], maxDists[start + i], &stream[i]);
+    }
+
+    rtcOccluded1M(scene, &context, stream, chunk, sizeof(RTCRay));
+
+    for (size_t i = 0; i < chunk; ++i) {
+      occludedOut[start + i] = stream[i].geomID == 0;
+    }
+  }
+}
+
+template<typename RTCRayN, int N>
+void Embree::intersectPacketN(
+  void (*rtcIntersectN)(const void*, RTCScene, RTCRayN&),
+  const Ray* rays,
+  int count,
+  Intersection* isectsOut,
+  bool* hitsOut
+) const {
+  alignas(64) RTCRayN packet;
+  alignas(64) int valid[N];
+
+  for (int i = 0; i < N; ++i) {
+    // Inactive lanes still get a well-formed ray; Embree ignores them.
+    const Ray& r = rays[i < count ? i : 0];
+    valid[i] = i < count ? -1 : 0;
+    packet.orgx[i] = r.origin.x();
+    packet.orgy[i] = r.origin.y();
+    packet.orgz[i] = r.origin.z();
+    packet.dirx[i] = r.direction.x();
+    packet.diry[i] = r.direction.y();
+    packet.dirz[i] = r.direction.z();
+    packet.tnear[i] = 0.0f;
+    packet.tfar[i] = math::VERY_BIG;
+    packet.geomID[i] = int(RTC_INVALID_GEOMETRY_ID);
+    packet.primID[i] = int(RTC_INVALID_GEOMETRY_ID);
+    packet.instID[i] = int(RTC_INVALID_GEOMETRY_ID);
+    packet.mask[i] = int(0xFFFFFFFF);
+    packet.time[i] = 0.0f;
+  }
+
+  rtcIntersectN(valid, scene, packet);
+
+  for (int i = 0; i < count; ++i) {
+    if (packet.geomID[i] == int(RTC_INVALID_GEOMETRY_ID)) {
+      hitsOut[i] = false;
+      continue;
+    }
+
+    // Unpack the lane so that the per-geom callbacks can be shared with
+    // Embree::intersect.
+    RTCRay ray;
+    ray.org[0] = packet.orgx[i];
+    ray.org[1] = packet.orgy[i];
+    ray.org[2] = packet.orgz[i];
+    ray.dir[0] = packet.dirx[i];
+    ray.dir[1] = packet.diry[i];
+    ray.dir[2] = packet.dirz[i];
+    ray.tnear = packet.tnear[i];
+    ray.tfar = packet.tfar[i];
+    ray.geomID = packet.geomID[i];
+    ray.primID = packet.primID[i];
+    ray.instID = packet.instID[i];
+    ray.mask = packet.mask[i];
+    ray.time = packet.time[i];
+    ray.Ng[0] = packet.Ngx[i];
+    ray.Ng[1] = packet.Ngy[i];
+    ray.Ng[2] = packet.Ngz[i];
+    ray.u = packet.u[i];
+    ray.v = packet.v[i];
+
+    const EmbreeObj* eo = embreeObjLookup.at(unsigned(ray.geomID));
+    eo->isectCallback(eo, ray, &isectsOut[i]);
+    hitsOut[i] = true;
+  }
+}
+
+void Embree::intersectPacket(
+  const Ray* rays,
+  int count,
+  Intersection* isectsOut,
+  bool* hitsOut
+) const {
+  assert(count > 0 && count <= packetSize);
+
+  switch (packetSize) {
+    case 16:
+      intersectPacketN<RTCRay16, 16>(
+        &rtcIntersect16, rays, count, isectsOut, hitsOut
+      );
+      break;
+    case 8:
+      intersectPacketN<RTCRay8, 8>(
+        &rtcIntersect8, rays, count, isectsOut, hitsOut
+      );
+      break;
+    default:
+      intersectPacketN<RTCRay4, 4>(
+        &rtcIntersect4, rays, count, isectsOut, hitsOut
+      );
+      break;
+  }
+}
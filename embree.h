@@ -13,8 +13,43 @@ class Geom;
 class Embree : public Accelerator {
   static bool embreeInited;
   static RTCDevice device;
+  static int packetSize;
   RTCScene scene;
 
+  /**
+   * The number of rays converted to RTCRay's and sent to Embree's stream API
+   * at a time by Embree::intersectMany and Embree::occludedMany.
+   */
+  static constexpr size_t STREAM_CHUNK_SIZE = 256;
+
+  /** Fills in an RTCRay for the given ray and maximum distance. */
+  static void makeRTCRay(const Ray& r, float maxDist, RTCRay* rayOut);
+
+  /**
+   * Picks the widest ray packet (4, 8, or 16) supported by both the CPU's
+   * instruction set (SSE, AVX, or AVX-512) and the Embree build, which may
+   * leave out the wider packet kernels. The device must already exist.
+   */
+  static int detectPacketSize();
+
+  /**
+   * Picks the widest ray packet (4, 8, or 16) supported by the CPU's
+   * instruction set (SSE, AVX, or AVX-512) alone.
+   */
+  static int detectCpuPacketSize();
+
+  /** Returns the RTC_INTERSECTn flag matching the packet size. */
+  static int packetAlgorithmFlags();
+
+  template<typename RTCRayN, int N>
+  void intersectPacketN(
+    void (*rtcIntersectN)(const void*, RTCScene, RTCRayN&),
+    const Ray* rays,
+    int count,
+    Intersection* isectsOut,
+    bool* hitsOut
+  ) const;
+
 public:
   struct EmbreeVert { float x, y, z, a; };
   struct EmbreeTri { int v0, v1, v2; };
@@ -34,14 +69,52 @@ public:
 
   Embree(const std::vector<const Geom*>& o);
 
+  /** The largest packet that Embree::intersectPacket will ever accept. */
+  static constexpr int MAX_PACKET_SIZE = 16;
+
   static void init();
   static void exit();
 
+  /**
+   * The number of rays that Embree::intersectPacket traces together on this
+   * CPU. Only valid after Embree::init.
+   */
+  static inline int getPacketSize() { return packetSize; }
+
   virtual bool intersect(
     const Ray& r,
     Intersection* isectOut
   ) const override;
   virtual bool intersectShadow(const Ray& r, float maxDist) const override;
+  virtual size_t intersectMany(
+    const Ray* rays,
+    size_t count,
+    RayHit* hitsOut
+  ) const override;
+  virtual void occludedMany(
+    const Ray* rays,
+    const float* maxDists,
+    size_t count,
+    bool* occludedOut
+  ) const override;
+
+  /**
+   * Intersects a packet of rays with the scene in a single traversal. This is
+   * much faster than intersecting the rays one by one if they are coherent,
+   * e.g. camera rays for neighboring pixels.
+   *
+   * @param rays            the rays to intersect
+   * @param count           the number of rays, 0 < count <= getPacketSize()
+   * @param isectsOut [out] the intersection information for each ray that
+   *                        hit some geometry, otherwise unmodified
+   * @param hitsOut   [out] whether each ray hit some geometry
+   */
+  void intersectPacket(
+    const Ray* rays,
+    int count,
+    Intersection* isectsOut,
+    bool* hitsOut
+  ) const;
 
 private:
   std::vector<EmbreeObj> embreeObjStorage;
@@ -0,0 +1,343 @@
+#include "exrwriter.h"
+#include "parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <boost/format.hpp>
+
+#ifdef _WIN32
+  #define NOMINMAX
+  #include <windows.h>
+#endif
+
+#define TINYEXR_IMPLEMENTATION
+#include <tinyexr.h>
+
+using boost::format;
+
+std::vector<float>& ExrFrame::addChannel(const std::string& name, bool half) {
+  Channel ch;
+  ch.name = name;
+  ch.data.resize(size_t(w * h), 0.0f);
+  ch.half = half;
+  channels.push_back(std::move(ch));
+  return channels.back().data;
+}
+
+ExrWriter::ExrWriter()
+  : mutex(), filesReady(), filesWritten(), pending(), writing(false),
+    stopping(false), compression(ExrCompression::NONE), fullFloat(false),
+    writeSeconds(0), error(), thread()
+{
+  thread = std::thread([this]() { run(); });
+}
+
+ExrWriter::~ExrWriter() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    filesWritten.wait(lock, [this]() { return pending.empty() && !writing; });
+    stopping = true;
+  }
+  filesReady.notify_one();
+  thread.join();
+}
+
+void ExrWriter::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    filesReady.wait(lock, [this]() { return stopping || !pending.empty(); });
+    if (stopping) {
+      return;
+    }
+
+    std::vector<File> files;
+    files.swap(pending);
+    ExrCompression fileCompression = compression;
+    bool fileFullFloat = fullFloat;
+    writing = true;
+
+    lock.unlock();
+    std::chrono::steady_clock::time_point startTime =
+      std::chrono::steady_clock::now();
+    std::exception_ptr fileError;
+    try {
+      for (const File& file : files) {
+        write(file.frame, file.name, fileCompression, fileFullFloat);
+      }
+    } catch (...) {
+      fileError = std::current_exception();
+    }
+    std::chrono::steady_clock::time_point endTime =
+      std::chrono::steady_clock::now();
+    lock.lock();
+
+    writing = false;
+    writeSeconds = std::chrono::duration_cast<std::chrono::duration<float>>(
+      endTime - startTime
+    ).count();
+    if (fileError && !error) {
+      error = fileError;
+    }
+    filesWritten.notify_all();
+  }
+}
+
+void ExrWriter::rethrowError() {
+  if (error) {
+    std::exception_ptr e = error;
+    error = nullptr;
+    std::rethrow_exception(e);
+  }
+}
+
+void ExrWriter::submit(std::vector<File>&& files) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    rethrowError();
+    pending = std::move(files);
+  }
+  filesReady.notify_one();
+}
+
+void ExrWriter::setFormat(ExrCompression c, bool ff) {
+  std::lock_guard<std::mutex> lock(mutex);
+  compression = c;
+  fullFloat = ff;
+}
+
+float ExrWriter::lastWriteSeconds() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return writeSeconds;
+}
+
+void ExrWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  filesWritten.wait(lock, [this]() { return pending.empty() && !writing; });
+  rethrowError();
+}
+
+/** Reads a little-endian 32-bit integer. */
+static int readInt32(const unsigned char* p) {
+  return int(
+    unsigned(p[0]) | unsigned(p[1]) << 8 | unsigned(p[2]) << 16
+      | unsigned(p[3]) << 24
+  );
+}
+
+/** Writes a little-endian 32-bit integer. */
+static void writeInt32(unsigned char* p, int value) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (unsigned char)(unsigned(value) >> (8 * i));
+  }
+}
+
+/** Appends a little-endian 64-bit integer. */
+static void appendUint64(std::vector<unsigned char>* out, uint64_t value) {
+  for (int i = 0; i < 8; ++i) {
+    out->push_back((unsigned char)(value >> (8 * i)));
+  }
+}
+
+/**
+ * Reads the header of a single-part scanline OpenEXR file.
+ *
+ * @param file            the bytes of the file
+ * @param lastRows  [out] the offsets of the last row of the data and display
+ *                        windows
+ * @returns               the size of the header
+ */
+static size_t readHeader(
+  const unsigned char* file,
+  std::vector<size_t>* lastRows
+) {
+  size_t pos = 8; // Skip the magic number and version.
+  while (file[pos] != 0) {
+    std::string name(reinterpret_cast<const char*>(file + pos));
+    pos += name.size() + 1;
+    std::string type(reinterpret_cast<const char*>(file + pos));
+    pos += type.size() + 1;
+    int size = readInt32(file + pos);
+    pos += 4;
+
+    // A box2i is xMin, yMin, xMax, yMax.
+    if (type == "box2i" && (name == "dataWindow" || name == "displayWindow")) {
+      lastRows->push_back(pos + 12);
+    }
+    pos += size_t(size);
+  }
+  return pos + 1;
+}
+
+void ExrWriter::write(
+  const ExrFrame& frame,
+  const std::string& fileName,
+  ExrCompression compression,
+  bool fullFloat
+) {
+  // EXR files list their channels in alphabetical order, which also puts
+  // the color channels in the BGR order that most EXR viewers expect.
+  std::vector<const ExrFrame::Channel*> channels;
+  for (const ExrFrame::Channel& ch : frame.channels) {
+    channels.push_back(&ch);
+  }
+  std::sort(
+    channels.begin(),
+    channels.end(),
+    [](const ExrFrame::Channel* a, const ExrFrame::Channel* b) {
+      return a->name < b->name;
+    }
+  );
+
+  std::vector<const char*> channelNames;
+  std::vector<int> pixelTypes;
+  std::vector<int> requestedPixelTypes;
+  for (const ExrFrame::Channel* ch : channels) {
+    channelNames.push_back(ch->name.c_str());
+    pixelTypes.push_back(TINYEXR_PIXELTYPE_FLOAT);
+    requestedPixelTypes.push_back(
+      ch->half && !fullFloat ? TINYEXR_PIXELTYPE_HALF : TINYEXR_PIXELTYPE_FLOAT
+    );
+  }
+
+  int compressionType;
+  int linesPerBlock;
+  switch (compression) {
+    case ExrCompression::ZIPS:
+      compressionType = TINYEXR_COMPRESSIONTYPE_ZIPS;
+      linesPerBlock = 1;
+      break;
+    case ExrCompression::ZIP:
+      compressionType = TINYEXR_COMPRESSIONTYPE_ZIP;
+      linesPerBlock = 16;
+      break;
+    case ExrCompression::PIZ:
+      compressionType = TINYEXR_COMPRESSIONTYPE_PIZ;
+      linesPerBlock = 32;
+      break;
+    case ExrCompression::NONE:
+    default:
+      compressionType = TINYEXR_COMPRESSIONTYPE_NONE;
+      linesPerBlock = 1;
+      break;
+  }
+
+  // tinyexr encodes an image on one thread, so encode each band of the
+  // image as an image of its own, in parallel. The bands start on block
+  // boundaries, so their blocks are the same as the whole image's; they
+  // only need their row numbers shifted before going under one header.
+  int numBands = (frame.h + BAND_LINES - 1) / BAND_LINES;
+  std::vector<std::vector<unsigned char>> bands(numBands);
+  std::vector<std::string> bandErrors(numBands);
+  parallel::parallel_for(0, numBands, [&](int band) {
+    int y0 = band * BAND_LINES;
+
+    std::vector<const float*> imagePtrs;
+    for (const ExrFrame::Channel* ch : channels) {
+      imagePtrs.push_back(ch->data.data() + size_t(y0 * frame.w));
+    }
+
+    EXRImage image;
+    InitEXRImage(&image);
+
+    image.num_channels = int(channels.size());
+    image.channel_names = channelNames.data();
+    image.images = reinterpret_cast<unsigned char**>(
+      const_cast<float**>(imagePtrs.data())
+    );
+    image.width = frame.w;
+    image.height = std::min(int(BAND_LINES), frame.h - y0);
+    image.compression = compressionType;
+    image.pixel_types = pixelTypes.data();
+    image.requested_pixel_types = requestedPixelTypes.data();
+
+    unsigned char* memory = nullptr;
+    const char* err = nullptr;
+    size_t size = SaveMultiChannelEXRToMemory(&image, &memory, &err);
+    if (size == 0) {
+      bandErrors[size_t(band)] = err ? err : "unknown error";
+    } else {
+      bands[size_t(band)].assign(memory, memory + size);
+    }
+    free(memory);
+  });
+
+  for (const std::string& err : bandErrors) {
+    if (!err.empty()) {
+      throw std::runtime_error(
+        str(format("Error writing EXR file: '%1%'") % err)
+      );
+    }
+  }
+
+  // Each band is a header, a table of block offsets, and the blocks, each
+  // starting with its first row and its size. Gather the blocks.
+  std::vector<unsigned char> blocks;
+  std::vector<size_t> blockOffsets;
+  for (int band = 0; band < numBands; ++band) {
+    std::vector<unsigned char>& bytes = bands[size_t(band)];
+    std::vector<size_t> lastRows;
+    size_t pos = readHeader(bytes.data(), &lastRows);
+
+    int y0 = band * BAND_LINES;
+    int bandH = std::min(int(BAND_LINES), frame.h - y0);
+    int bandBlocks = (bandH + linesPerBlock - 1) / linesPerBlock;
+    pos += 8 * size_t(bandBlocks);
+
+    for (int i = 0; i < bandBlocks; ++i) {
+      unsigned char* block = bytes.data() + pos;
+      size_t blockSize = 8 + size_t(readInt32(block + 4));
+      writeInt32(block, readInt32(block) + y0);
+      blockOffsets.push_back(blocks.size());
+      blocks.insert(blocks.end(), block, block + blockSize);
+      pos += blockSize;
+    }
+  }
+
+  // Take the header from the first band, and stretch its windows over the
+  // whole image.
+  std::vector<unsigned char> file(bands[0]);
+  std::vector<size_t> lastRows;
+  file.resize(readHeader(file.data(), &lastRows));
+  for (size_t offset : lastRows) {
+    writeInt32(file.data() + offset, frame.h - 1);
+  }
+
+  size_t blocksStart = file.size() + 8 * blockOffsets.size();
+  for (size_t offset : blockOffsets) {
+    appendUint64(&file, uint64_t(blocksStart + offset));
+  }
+  file.insert(file.end(), blocks.begin(), blocks.end());
+
+  std::string tempName = fileName + ".tmp";
+  {
+    std::ofstream out(tempName, std::ios::binary);
+    out.write(
+      reinterpret_cast<const char*>(file.data()), std::streamsize(file.size())
+    );
+    if (!out) {
+      out.close();
+      std::remove(tempName.c_str());
+      throw std::runtime_error(
+        str(format("Error writing EXR file: '%1%'") % tempName)
+      );
+    }
+  }
+
+#ifdef _WIN32
+  bool renamed = MoveFileExA(
+    tempName.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING
+  ) != 0;
+#else
+  bool renamed = std::rename(tempName.c_str(), fileName.c_str()) == 0;
+#endif
+
+  if (!renamed) {
+    throw std::runtime_error(
+      str(format("Error renaming '%1%' to '%2%'") % tempName % fileName)
+    );
+  }
+}
@@ -0,0 +1,161 @@
+#pragma once
+#include "options.h"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * The channels of an image, ready to be encoded as an OpenEXR file.
+ */
+struct ExrFrame {
+  /** One channel of the image. */
+  struct Channel {
+    std::string name; /**< The name of the channel, e.g. "R" or "N.X". */
+    std::vector<float> data; /**< The values, in row-major order. */
+    bool half; /**< Whether to store the values as half-floats. */
+  };
+
+  int w; /**< The width of the image. */
+  int h; /**< The height of the image. */
+  /**
+   * The channels, in any order. A deque, so that adding a channel leaves
+   * the others in place.
+   */
+  std::deque<Channel> channels;
+
+  /**
+   * Constructs a frame with no channels.
+   */
+  ExrFrame(int ww, int hh) : w(ww), h(hh), channels() {}
+
+  /**
+   * Adds a channel to the frame.
+   *
+   * @param name the name of the channel
+   * @param half whether to store the channel as half-floats
+   * @returns    the channel's values, sized for the image and zeroed; the
+   *             reference stays valid as long as the frame
+   */
+  std::vector<float>& addChannel(const std::string& name, bool half);
+};
+
+/**
+ * Writes OpenEXR files on a background thread, so that rendering does not
+ * wait for encoding and disk I/O. There is room for one set of files being
+ * written and one set waiting; a set that is still waiting when the next
+ * one arrives is out of date, so it is dropped instead of written.
+ *
+ * Each file is written under a temporary name first and then renamed over
+ * the old file, so that viewers never see a partially-written image.
+ */
+class ExrWriter {
+  /**
+   * The number of scanlines in each band of the image that is encoded on its
+   * own; a multiple of the block size of every compression.
+   */
+  static constexpr int BAND_LINES = 64;
+
+public:
+  /** A file to be written. */
+  struct File {
+    std::string name; /**< The name of the output file. */
+    ExrFrame frame; /**< The image to write. */
+
+    File(const std::string& n, ExrFrame&& f) : name(n), frame(std::move(f)) {}
+  };
+
+private:
+  std::mutex mutex; /**< Guards all of the members below. */
+  /** Wakes the writer thread when files arrive or it must stop. */
+  std::condition_variable filesReady;
+  /** Wakes the threads waiting in ExrWriter::flush. */
+  std::condition_variable filesWritten;
+  std::vector<File> pending; /**< The files waiting to be written. */
+  bool writing; /**< Whether the writer thread is writing files. */
+  bool stopping; /**< Whether the writer thread should exit. */
+  ExrCompression compression; /**< How to compress the files. */
+  bool fullFloat; /**< Whether to store every channel as floats. */
+  /** How long the last set of files took to write, in seconds. */
+  float writeSeconds;
+  /** The first error from the writer thread that was not yet reported. */
+  std::exception_ptr error;
+  std::thread thread; /**< The writer thread. */
+
+  /** The body of the writer thread. */
+  void run();
+
+  /**
+   * Rethrows the error from the writer thread, if any. The mutex must be
+   * held.
+   */
+  void rethrowError();
+
+public:
+  /**
+   * Starts the writer thread.
+   */
+  ExrWriter();
+
+  /**
+   * Waits for the files that were submitted to be written (dropping any
+   * errors), and stops the writer thread.
+   */
+  ~ExrWriter();
+
+  ExrWriter(const ExrWriter&) = delete;
+  ExrWriter& operator=(const ExrWriter&) = delete;
+
+  /**
+   * Writes a frame to an OpenEXR file on disk. The calling thread waits,
+   * but the image is split into bands of scanlines that are converted and
+   * compressed in parallel.
+   *
+   * @param frame       the image to write
+   * @param fileName    the name of the output file
+   * @param compression how to compress the pixels
+   * @param fullFloat   whether to store every channel as floats, even those
+   *                    that ask for half-floats
+   * @throws std::runtime_error if the file could not be written
+   */
+  static void write(
+    const ExrFrame& frame,
+    const std::string& fileName,
+    ExrCompression compression,
+    bool fullFloat
+  );
+
+  /**
+   * Sets how the files that are written from now on are stored. The default is
+   * uncompressed, with the channel types that the frames ask for.
+   *
+   * @param c  how to compress the pixels
+   * @param ff whether to store every channel as floats
+   */
+  void setFormat(ExrCompression c, bool ff);
+
+  /**
+   * Queues a set of files to be written on the writer thread, replacing any
+   * set that is still waiting. Returns right away.
+   *
+   * @param files the files to write
+   * @throws std::runtime_error if writing an earlier set of files failed
+   */
+  void submit(std::vector<File>&& files);
+
+  /**
+   * Returns how long the writer thread took to write the last set of files,
+   * in seconds, or 0 if it has not written any yet.
+   */
+  float lastWriteSeconds();
+
+  /**
+   * Waits until all of the submitted files have been written.
+   *
+   * @throws std::runtime_error if writing any of them failed
+   */
+  void flush();
+};
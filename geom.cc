@@ -15,6 +15,98 @@ BSphere Geom::boundSphere() const {
   return BSphere(boundBox());
 }
 
+NormalCone Geom::normalCone() const {
+  return NormalCone();
+}
+
+float Geom::areaToSolidAnglePDF(
+  float areaPdf,
+  const Vec& point,
+  const Vec& pos,
+  const Vec& normal
+) {
+  Vec toPos = pos - point;
+  float dist2 = toPos.squaredNorm();
+  float cosTheta = fabsf(normal.dot(toPos)) / sqrtf(dist2);
+  if (math::isNearlyZero(cosTheta)) {
+    return 0.0f;
+  }
+
+  return areaPdf * dist2 / cosTheta;
+}
+
+bool Geom::samplePoint(
+  Sampler& sampler,
+  const Vec& point,
+  Vec* posOut,
+  Vec* normalOut,
+  float* pdfOut
+) const {
+  Vec dir;
+  float pdf;
+
+  BSphere bounds = boundSphere();
+  if (bounds.contains(point)) {
+    // We're inside the bounding sphere, so sample sphere uniformly.
+    dir = math::uniformSampleSphere(sampler.next2D());
+    pdf = math::uniformSampleSpherePDF();
+  } else {
+    // We're outside the bounding sphere, so sample by solid angle.
+    Vec dirToOrigin = bounds.origin - point;
+    float theta = asinf(bounds.radius / dirToOrigin.norm());
+
+    Vec normal = dirToOrigin.normalized();
+    Vec tangent;
+    Vec binormal;
+    math::coordSystem(normal, &tangent, &binormal);
+
+    dir = math::localToWorld(
+      math::uniformSampleCone(sampler.next2D(), theta),
+      tangent,
+      binormal,
+      normal
+    );
+    pdf = math::uniformSampleConePDF(theta);
+  }
+
+  Intersection isect;
+  if (!intersect(Ray(point, dir), &isect)) {
+    // The sampled cone doesn't exactly correspond with the geometry.
+    return false;
+  }
+
+  *posOut = isect.position;
+  *normalOut = isect.normal;
+  *pdfOut = pdf;
+  return true;
+}
+
+float Geom::samplePointPDF(
+  const Vec& point,
+  const Intersection& isect
+) const {
+  BSphere bounds = boundSphere();
+  if (bounds.contains(point)) {
+    return math::uniformSampleSpherePDF();
+  }
+
+  Vec dirToOrigin = bounds.origin - point;
+  float theta = asinf(bounds.radius / dirToOrigin.norm());
+
+  Vec normal = dirToOrigin.normalized();
+  Vec tangent;
+  Vec binormal;
+  math::coordSystem(normal, &tangent, &binormal);
+
+  Vec dirLocal = math::worldToLocal(
+    (isect.position - point).normalized(),
+    tangent,
+    binormal,
+    normal
+  );
+  return math::uniformSampleConePDF(theta, dirLocal);
+}
+
 void Geom::embreeBoundsFunc(void* user, size_t /* i */, RTCBounds& bounds) {
   const Embree::EmbreeObj* eo = reinterpret_cast<Embree::EmbreeObj*>(user);
   BBox b = eo->geom->boundBox();
@@ -56,6 +148,64 @@ void Geom::embreeOccludedFunc(void* user, RTCRay& ray, size_t /* i */) {
   }
 }
 
+template<typename RTCRayN, int N>
+void Geom::embreeIntersectFuncN(
+  const void* valid,
+  void* user,
+  RTCRayN& ray,
+  size_t i
+) {
+  // Packets are only used for camera rays, so just intersect each active
+  // lane in turn.
+  const Embree::EmbreeObj* eo = reinterpret_cast<Embree::EmbreeObj*>(user);
+  const int* laneValid = reinterpret_cast<const int*>(valid);
+  for (int lane = 0; lane < N; ++lane) {
+    if (laneValid[lane] == 0) {
+      continue;
+    }
+
+    Ray r(
+      Vec(ray.orgx[lane], ray.orgy[lane], ray.orgz[lane]),
+      Vec(ray.dirx[lane], ray.diry[lane], ray.dirz[lane])
+    );
+    Intersection isect;
+    if (eo->geom->intersect(r, &isect)) {
+      ray.u[lane] = 0.0f;
+      ray.v[lane] = 0.0f;
+      ray.tfar[lane] = isect.distance;
+      ray.geomID[lane] = int(eo->geomId);
+      ray.primID[lane] = int(i);
+      ray.Ngx[lane] = isect.normal.x();
+      ray.Ngy[lane] = isect.normal.y();
+      ray.Ngz[lane] = isect.normal.z();
+    }
+  }
+}
+
+template<typename RTCRayN, int N>
+void Geom::embreeOccludedFuncN(
+  const void* valid,
+  void* user,
+  RTCRayN& ray,
+  size_t /* i */
+) {
+  const Embree::EmbreeObj* eo = reinterpret_cast<Embree::EmbreeObj*>(user);
+  const int* laneValid = reinterpret_cast<const int*>(valid);
+  for (int lane = 0; lane < N; ++lane) {
+    if (laneValid[lane] == 0) {
+      continue;
+    }
+
+    Ray r(
+      Vec(ray.orgx[lane], ray.orgy[lane], ray.orgz[lane]),
+      Vec(ray.dirx[lane], ray.diry[lane], ray.dirz[lane])
+    );
+    if (eo->geom->intersectShadow(r, ray.tfar[lane])) {
+      ray.geomID[lane] = 0;
+    }
+  }
+}
+
 void Geom::embreeIntersectCallback(
   const Embree::EmbreeObj* eo,
   const RTCRay& ray,
@@ -83,4 +233,22 @@ void Geom::makeEmbreeObject(RTCScene scene, Embree::EmbreeObj& eo) const {
   rtcSetBoundsFunction(scene, geomId, &Geom::embreeBoundsFunc);
   rtcSetIntersectFunction(scene, geomId, &Geom::embreeIntersectFunc);
   rtcSetOccludedFunction(scene, geomId, &Geom::embreeOccludedFunc);
+  rtcSetIntersectFunction4(
+    scene, geomId, &Geom::embreeIntersectFuncN<RTCRay4, 4>
+  );
+  rtcSetIntersectFunction8(
+    scene, geomId, &Geom::embreeIntersectFuncN<RTCRay8, 8>
+  );
+  rtcSetIntersectFunction16(
+    scene, geomId, &Geom::embreeIntersectFuncN<RTCRay16, 16>
+  );
+  rtcSetOccludedFunction4(
+    scene, geomId, &Geom::embreeOccludedFuncN<RTCRay4, 4>
+  );
+  rtcSetOccludedFunction8(
+    scene, geomId, &Geom::embreeOccludedFuncN<RTCRay8, 8>
+  );
+  rtcSetOccludedFunction16(
+    scene, geomId, &Geom::embreeOccludedFuncN<RTCRay16, 16>
+  );
 }
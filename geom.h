@@ -1,5 +1,6 @@
 #pragma once
 #include "core.h"
+#include "sampler.h"
 #include "node.h"
 #include "embree.h"
 
@@ -13,6 +14,20 @@ class Geom {
   static void embreeBoundsFunc(void* user, size_t i, RTCBounds& bounds);
   static void embreeIntersectFunc(void* user, RTCRay& ray, size_t i);
   static void embreeOccludedFunc(void* user , RTCRay& ray, size_t i);
+  template<typename RTCRayN, int N>
+  static void embreeIntersectFuncN(
+    const void* valid,
+    void* user,
+    RTCRayN& ray,
+    size_t i
+  );
+  template<typename RTCRayN, int N>
+  static void embreeOccludedFuncN(
+    const void* valid,
+    void* user,
+    RTCRayN& ray,
+    size_t i
+  );
   static void embreeIntersectCallback(
     const Embree::EmbreeObj* eo,
     const RTCRay& ray,
@@ -20,6 +35,24 @@ class Geom {
   );
 
 protected:
+  /**
+   * Converts a PDF with respect to surface area into a PDF with respect to
+   * solid angle as seen from another point.
+   *
+   * @param areaPdf the PDF with respect to surface area
+   * @param point   the point from which the surface is seen
+   * @param pos     the point on the surface
+   * @param normal  the geometric normal of the surface at pos
+   * @returns       the PDF with respect to solid angle, or 0 if the surface is
+   *                seen exactly edge-on
+   */
+  static float areaToSolidAnglePDF(
+    float areaPdf,
+    const Vec& point,
+    const Vec& pos,
+    const Vec& normal
+  );
+
   /**
    * Constructs a geom with the specified material.
    *
@@ -72,6 +105,54 @@ public:
    */
   virtual BSphere boundSphere() const;
 
+  /**
+   * The total surface area of the geometry.
+   */
+  virtual float area() const = 0;
+
+  /**
+   * A cone bounding the surface normals of the geometry, i.e. the directions
+   * in which it can emit light.
+   * If this method is not overriden, then the cone contains every direction.
+   */
+  virtual NormalCone normalCone() const;
+
+  /**
+   * Samples a point on the surface of the geometry as seen from another
+   * point, e.g. to light that point. If this method is not overriden, then a
+   * direction in the cone subtended by the bounding sphere is sampled and
+   * intersected with the geometry, which may miss.
+   *
+   * @param sampler         the per-thread sampler in use
+   * @param point           the point from which the geometry is seen
+   * @param posOut    [out] the sampled point on the surface
+   * @param normalOut [out] the surface normal at the sampled point
+   * @param pdfOut    [out] the probability of sampling the direction from
+   *                        point towards posOut, with respect to solid angle
+   * @returns               true if a point was sampled, false otherwise (in
+   *                        which case the outputs are unmodified)
+   */
+  virtual bool samplePoint(
+    Sampler& sampler,
+    const Vec& point,
+    Vec* posOut,
+    Vec* normalOut,
+    float* pdfOut
+  ) const;
+
+  /**
+   * Returns the probability, with respect to solid angle, that
+   * Geom::samplePoint would have sampled the direction from point towards
+   * an intersection on the geometry.
+   *
+   * @param point the point from which the geometry is seen
+   * @param isect an intersection on the geometry, of a ray cast from point
+   */
+  virtual float samplePointPDF(
+    const Vec& point,
+    const Intersection& isect
+  ) const;
+
   /**
    * Refines a composite object into its constituent parts until the
    * parts can be intersected.
@@ -93,3 +93,46 @@ BBox geoms::Disc::boundBox() const {
 BSphere geoms::Disc::boundSphere() const {
   return BSphere(origin, radiusOuter);
 }
+
+float geoms::Disc::area() const {
+  return math::PI * (radiusOuterSquared - radiusInnerSquared);
+}
+
+NormalCone geoms::Disc::normalCone() const {
+  return NormalCone(normal);
+}
+
+bool geoms::Disc::samplePoint(
+  Sampler& sampler,
+  const Vec& point,
+  Vec* posOut,
+  Vec* normalOut,
+  float* pdfOut
+) const {
+  // Uniformly sample the annulus between the inner and outer radii.
+  Vec2 u = sampler.next2D();
+  float r = sqrtf(math::lerp(radiusInnerSquared, radiusOuterSquared, u[0]));
+  float phi = math::TWO_PI * u[1];
+
+  Vec tangent;
+  Vec binormal;
+  math::coordSystem(normal, &tangent, &binormal);
+
+  Vec pos = origin + r * (cosf(phi) * tangent + sinf(phi) * binormal);
+  float pdf = areaToSolidAnglePDF(1.0f / area(), point, pos, normal);
+  if (pdf <= 0.0f) {
+    return false;
+  }
+
+  *posOut = pos;
+  *normalOut = normal;
+  *pdfOut = pdf;
+  return true;
+}
+
+float geoms::Disc::samplePointPDF(
+  const Vec& point,
+  const Intersection& isect
+) const {
+  return areaToSolidAnglePDF(1.0f / area(), point, isect.position, normal);
+}
@@ -50,6 +50,19 @@ namespace geoms {
     virtual bool intersectShadow(const Ray& r, float maxDist) const override;
     virtual BBox boundBox() const override;
     virtual BSphere boundSphere() const override;
+    virtual float area() const override;
+    virtual bool samplePoint(
+      Sampler& sampler,
+      const Vec& point,
+      Vec* posOut,
+      Vec* normalOut,
+      float* pdfOut
+    ) const override;
+    virtual float samplePointPDF(
+      const Vec& point,
+      const Intersection& isect
+    ) const override;
+    virtual NormalCone normalCone() const override;
   };
 
 }
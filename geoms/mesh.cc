@@ -105,6 +105,14 @@ BBox geoms::Mesh::boundBox() const {
   return debug::shouldNotReach(BBox());
 }
 
+float geoms::Mesh::area() const {
+  float total = 0.0f;
+  for (const Poly& p : faces) {
+    total += p.area();
+  }
+  return total;
+}
+
 void geoms::Mesh::refine(std::vector<const Geom*>& refined) const {
   for (const Poly& p : faces) {
     refined.push_back(&p);
@@ -134,7 +142,9 @@ void geoms::Mesh::embreeIntersectCallback(
   isectOut->distance = ray.tfar;
   isectOut->normal =
     (w * p.pt0->normal + u * p.pt1->normal + v * p.pt2->normal).normalized();
-  isectOut->geom = eo->geom;
+  // Report the face rather than the mesh, so that the hit can be matched
+  // against the refined emitters.
+  isectOut->geom = &p;
 }
 
 void geoms::Mesh::makeEmbreeObject(RTCScene scene, Embree::EmbreeObj& eo) const {
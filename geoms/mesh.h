@@ -67,6 +67,7 @@ namespace geoms {
     virtual bool intersect(const Ray& r, Intersection* isectOut) const override;
     virtual bool intersectShadow(const Ray& r, float maxDist) const override;
     virtual BBox boundBox() const override;
+    virtual float area() const override;
     virtual void refine(std::vector<const Geom*>& refined) const override;
     virtual void makeEmbreeObject(
       RTCScene scene,
@@ -108,3 +108,60 @@ BBox geoms::Poly::boundBox() const {
 
   return b;
 }
+
+float geoms::Poly::area() const {
+  Vec e1 = pt1->position - pt0->position;
+  Vec e2 = pt2->position - pt0->position;
+  return 0.5f * e1.cross(e2).norm();
+}
+
+NormalCone geoms::Poly::normalCone() const {
+  // The interpolated normals all lie within the cone of the vertex normals.
+  NormalCone c(pt0->normal.normalized());
+  c.expand(NormalCone(pt1->normal.normalized()));
+  c.expand(NormalCone(pt2->normal.normalized()));
+  return c;
+}
+
+bool geoms::Poly::samplePoint(
+  Sampler& sampler,
+  const Vec& point,
+  Vec* posOut,
+  Vec* normalOut,
+  float* pdfOut
+) const {
+  // Uniformly sample the barycentric coordinates; see Pharr & Humphreys
+  // p. 671.
+  Vec2 s = sampler.next2D();
+  float su = sqrtf(s[0]);
+  float u = 1.0f - su;
+  float v = s[1] * su;
+  float w = 1.0f - u - v;
+
+  Vec pos = u * pt0->position + v * pt1->position + w * pt2->position;
+  Vec faceNormal =
+    (pt1->position - pt0->position).cross(pt2->position - pt0->position);
+  float pdf = areaToSolidAnglePDF(
+    1.0f / area(), point, pos, faceNormal.normalized()
+  );
+  if (pdf <= 0.0f) {
+    return false;
+  }
+
+  *posOut = pos;
+  *normalOut = (u * pt0->normal + v * pt1->normal + w * pt2->normal)
+    .normalized();
+  *pdfOut = pdf;
+  return true;
+}
+
+float geoms::Poly::samplePointPDF(
+  const Vec& point,
+  const Intersection& isect
+) const {
+  Vec faceNormal =
+    (pt1->position - pt0->position).cross(pt2->position - pt0->position);
+  return areaToSolidAnglePDF(
+    1.0f / area(), point, isect.position, faceNormal.normalized()
+  );
+}
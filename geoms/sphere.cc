@@ -88,3 +88,75 @@ BBox geoms::Sphere::boundBox() const {
 BSphere geoms::Sphere::boundSphere() const {
   return BSphere(origin, radius);
 }
+
+float geoms::Sphere::area() const {
+  return 4.0f * math::PI * radius * radius;
+}
+
+bool geoms::Sphere::samplePoint(
+  Sampler& sampler,
+  const Vec& point,
+  Vec* posOut,
+  Vec* normalOut,
+  float* pdfOut
+) const {
+  Vec dirToOrigin = origin - point;
+  float dist2 = dirToOrigin.squaredNorm();
+
+  Vec pos;
+  float pdf;
+  if (dist2 <= radius * radius) {
+    // We're inside the sphere, so sample its whole area uniformly.
+    pos = origin + radius * math::uniformSampleSphere(sampler.next2D());
+    pdf = areaToSolidAnglePDF(
+      1.0f / area(), point, pos, (pos - origin) / radius
+    );
+  } else {
+    // We're outside the sphere, so sample the cone subtended by the visible
+    // cap uniformly by solid angle. See Pharr & Humphreys p. 710.
+    float dist = sqrtf(dist2);
+    float theta = asinf(radius / dist);
+
+    Vec axis = dirToOrigin / dist;
+    Vec tangent;
+    Vec binormal;
+    math::coordSystem(axis, &tangent, &binormal);
+
+    Vec dirLocal = math::uniformSampleCone(sampler.next2D(), theta);
+    Vec dir = math::localToWorld(dirLocal, tangent, binormal, axis);
+
+    // Find the near intersection of the sampled direction with the sphere in
+    // closed form.
+    float cosAlpha = dirLocal.z();
+    float sinAlpha2 = max(0.0f, 1.0f - cosAlpha * cosAlpha);
+    float t = dist * cosAlpha
+      - sqrtf(max(0.0f, radius * radius - dist2 * sinAlpha2));
+
+    pos = point + t * dir;
+    pdf = math::uniformSampleConePDF(theta);
+  }
+
+  if (pdf <= 0.0f) {
+    return false;
+  }
+
+  Vec outward = (pos - origin).normalized();
+  *posOut = pos;
+  *normalOut = inverted ? Vec(-outward) : outward;
+  *pdfOut = pdf;
+  return true;
+}
+
+float geoms::Sphere::samplePointPDF(
+  const Vec& point,
+  const Intersection& isect
+) const {
+  float dist2 = (origin - point).squaredNorm();
+  if (dist2 <= radius * radius) {
+    return areaToSolidAnglePDF(
+      1.0f / area(), point, isect.position, (isect.position - origin) / radius
+    );
+  }
+
+  return math::uniformSampleConePDF(asinf(radius / sqrtf(dist2)));
+}
@@ -0,0 +1,407 @@
+#include "guiding.h"
+#include "geom.h"
+#include "material.h"
+#include "parallel.h"
+
+/** Atomically adds to a float, since std::atomic<float> has no fetch_add. */
+static inline void atomicAdd(std::atomic<float>& a, float value) {
+  float current = a.load(std::memory_order_relaxed);
+  while (!a.compare_exchange_weak(
+    current, current + value, std::memory_order_relaxed
+  )) {}
+}
+
+DirectionalQuadtree::Node::Node() {
+  for (int i = 0; i < 4; ++i) {
+    sums[i].store(0.0f, std::memory_order_relaxed);
+    children[i] = 0;
+  }
+}
+
+DirectionalQuadtree::Node::Node(const Node& other) {
+  *this = other;
+}
+
+DirectionalQuadtree::Node& DirectionalQuadtree::Node::operator=(
+  const Node& other
+) {
+  for (int i = 0; i < 4; ++i) {
+    sums[i].store(
+      other.sums[i].load(std::memory_order_relaxed),
+      std::memory_order_relaxed
+    );
+    children[i] = other.children[i];
+  }
+  return *this;
+}
+
+float DirectionalQuadtree::Node::total() const {
+  float t = 0.0f;
+  for (int i = 0; i < 4; ++i) {
+    t += sums[i].load(std::memory_order_relaxed);
+  }
+  return t;
+}
+
+DirectionalQuadtree::DirectionalQuadtree() : nodes(1) {}
+
+Vec2 DirectionalQuadtree::directionToSquare(const Vec& dir) {
+  float cosTheta = math::clamp(dir.z(), -1.0f, 1.0f);
+  float phi = atan2f(dir.y(), dir.x());
+  if (phi < 0.0f) {
+    phi += math::TWO_PI;
+  }
+
+  return Vec2(
+    math::clamp((cosTheta + 1.0f) * 0.5f, 0.0f, 0.99999994f),
+    math::clamp(phi / math::TWO_PI, 0.0f, 0.99999994f)
+  );
+}
+
+Vec DirectionalQuadtree::squareToDirection(const Vec2& p) {
+  float cosTheta = 2.0f * p.x() - 1.0f;
+  float sinTheta = sqrtf(max(0.0f, 1.0f - cosTheta * cosTheta));
+  float phi = math::TWO_PI * p.y();
+
+  return Vec(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+}
+
+void DirectionalQuadtree::record(const Vec& dir, float value) {
+  Vec2 p = directionToSquare(dir);
+
+  int node = 0;
+  while (true) {
+    int qx = p.x() >= 0.5f ? 1 : 0;
+    int qy = p.y() >= 0.5f ? 1 : 0;
+    int q = qx + 2 * qy;
+    atomicAdd(nodes[size_t(node)].sums[q], value);
+
+    node = nodes[size_t(node)].children[q];
+    if (node == 0) {
+      break;
+    }
+
+    p = Vec2(p.x() * 2.0f - float(qx), p.y() * 2.0f - float(qy));
+  }
+}
+
+bool DirectionalQuadtree::hasData() const {
+  return nodes[0].total() > 0.0f;
+}
+
+Vec DirectionalQuadtree::sample(Sampler& sampler) const {
+  Vec2 origin(0, 0);
+  float size = 1.0f;
+
+  // As in LightBVH::sample, one sample value drives the whole descent and is
+  // rescaled to [0, 1) within each quadrant picked.
+  float u = sampler.next1D();
+  int node = 0;
+  while (true) {
+    const Node& n = nodes[size_t(node)];
+    float total = n.total();
+
+    // Pick a quadrant proportionally to its radiance.
+    int q = 3;
+    if (total > 0.0f) {
+      float r = u * total;
+      for (int i = 0; i < 3; ++i) {
+        float s = n.sums[i].load(std::memory_order_relaxed);
+        if (r < s) {
+          q = i;
+          break;
+        }
+        r -= s;
+      }
+      float s = n.sums[q].load(std::memory_order_relaxed);
+      u = s > 0.0f ? min(r / s, math::ONE_MINUS_EPSILON) : 0.0f;
+    } else {
+      q = min(int(u * 4.0f), 3);
+      u = min(u * 4.0f - float(q), math::ONE_MINUS_EPSILON);
+    }
+
+    size *= 0.5f;
+    origin += Vec2(float(q % 2), float(q / 2)) * size;
+
+    node = n.children[q];
+    if (node == 0) {
+      break;
+    }
+  }
+
+  // Sample uniformly within the leaf quadrant.
+  Vec2 p = origin + sampler.next2D() * size;
+  return squareToDirection(p);
+}
+
+float DirectionalQuadtree::pdf(const Vec& dir) const {
+  Vec2 p = directionToSquare(dir);
+  float pdfSquare = 1.0f;
+
+  int node = 0;
+  while (true) {
+    const Node& n = nodes[size_t(node)];
+    float total = n.total();
+
+    int qx = p.x() >= 0.5f ? 1 : 0;
+    int qy = p.y() >= 0.5f ? 1 : 0;
+    int q = qx + 2 * qy;
+
+    if (total > 0.0f) {
+      pdfSquare *= 4.0f * n.sums[q].load(std::memory_order_relaxed) / total;
+    }
+
+    node = n.children[q];
+    if (node == 0 || pdfSquare == 0.0f) {
+      break;
+    }
+
+    p = Vec2(p.x() * 2.0f - float(qx), p.y() * 2.0f - float(qy));
+  }
+
+  // The unit square maps onto the unit sphere (area 4 * pi) with a constant
+  // Jacobian.
+  return pdfSquare / math::FOUR_PI;
+}
+
+void DirectionalQuadtree::refine() {
+  float total = nodes[0].total();
+  std::vector<Node> refined(1);
+
+  if (total <= 0.0f) {
+    nodes.swap(refined);
+    return;
+  }
+
+  // Walk the old tree alongside the new one. Where the old tree has no
+  // children, its radiance is assumed to be spread evenly over the quadrant.
+  struct Entry {
+    int newNode;
+    int oldNode; // Or -1 if the old tree had a leaf here.
+    float oldSum; // The radiance of the quadrant in the old tree.
+    int depth;
+  };
+
+  std::vector<Entry> stack;
+  stack.push_back(Entry { 0, 0, total, 1 });
+
+  while (!stack.empty()) {
+    Entry e = stack.back();
+    stack.pop_back();
+
+    for (int q = 0; q < 4; ++q) {
+      float sum;
+      int oldChild = -1;
+      if (e.oldNode >= 0) {
+        const Node& old = nodes[size_t(e.oldNode)];
+        sum = old.sums[q].load(std::memory_order_relaxed);
+        oldChild = old.children[q] != 0 ? old.children[q] : -1;
+      } else {
+        sum = e.oldSum * 0.25f;
+      }
+
+      if (e.depth < MAX_DEPTH && sum / total > SUBDIVIDE_FRACTION) {
+        int child = int(refined.size());
+        refined.push_back(Node());
+        refined[size_t(e.newNode)].children[q] = child;
+        stack.push_back(Entry { child, oldChild, sum, e.depth + 1 });
+      }
+    }
+  }
+
+  nodes.swap(refined);
+}
+
+GuidingTree::Leaf::Leaf() : sampling(), building(), samples(0) {}
+
+GuidingTree::Leaf::Leaf(const Leaf& other)
+  : sampling(other.sampling), building(other.building),
+    samples(other.samples.load(std::memory_order_relaxed)) {}
+
+GuidingTree::GuidingTree(const std::vector<const Geom*>& objs)
+  : bounds(), nodes(), leaves(1)
+{
+  std::vector<const Geom*> refined;
+  for (const Geom* g : objs) {
+    g->refine(refined);
+  }
+
+  if (!refined.empty()) {
+    bounds = refined[0]->boundBox();
+    for (const Geom* g : refined) {
+      BBox b = g->boundBox();
+      bounds.expand(b.lower);
+      bounds.expand(b.upper);
+    }
+  }
+
+  Node root;
+  root.children[0] = 0;
+  root.children[1] = 0;
+  root.leaf = 0;
+  root.depth = 0;
+  nodes.push_back(root);
+}
+
+int GuidingTree::lookup(const Vec& pos) const {
+  Vec lower = bounds.lower;
+  Vec upper = bounds.upper;
+
+  int node = 0;
+  while (nodes[size_t(node)].children[0] != 0) {
+    const Node& n = nodes[size_t(node)];
+    int axis = n.depth % 3;
+    float mid = 0.5f * (lower[axis] + upper[axis]);
+
+    if (pos[axis] < mid) {
+      upper[axis] = mid;
+      node = n.children[0];
+    } else {
+      lower[axis] = mid;
+      node = n.children[1];
+    }
+  }
+
+  return nodes[size_t(node)].leaf;
+}
+
+void GuidingTree::scatter(
+  Sampler& sampler,
+  const Intersection& isect,
+  int leaf,
+  Ray* rayOut,
+  Vec* betaInOut,
+  float* pdfOut
+) const {
+  const Material* mat = isect.geom->mat;
+  const DirectionalQuadtree& guide = leaves[size_t(leaf)].sampling;
+  Vec incomingWorld = -isect.incomingRay.direction;
+  float guidedFraction = guide.hasData() ? GUIDED_FRACTION : 0.0f;
+
+  // One-sample MIS: pick one of the two strategies at random, then weight
+  // by the balance heuristic, i.e. divide by the mixture PDF.
+  Vec outgoingWorld;
+  Vec bsdf;
+  float bsdfPdf;
+  if (sampler.next1D() < guidedFraction) {
+    outgoingWorld = guide.sample(sampler);
+    mat->evalWorld(isect, incomingWorld, outgoingWorld, &bsdf, &bsdfPdf);
+  } else {
+    mat->sampleWorld(
+      isect, sampler, incomingWorld, &outgoingWorld, &bsdf, &bsdfPdf
+    );
+  }
+
+  float pdf = (1.0f - guidedFraction) * bsdfPdf;
+  if (guidedFraction > 0.0f) {
+    pdf += guidedFraction * guide.pdf(outgoingWorld);
+  }
+
+  Vec scale;
+  if (pdf > 0.0f) {
+    scale = bsdf * fabsf(isect.normal.dot(outgoingWorld)) / pdf;
+  } else {
+    scale = Vec(0, 0, 0);
+  }
+
+  *rayOut = Ray(
+    isect.position + outgoingWorld * math::VERY_SMALL,
+    outgoingWorld
+  );
+  *betaInOut = betaInOut->cwiseProduct(scale);
+  *pdfOut = pdf;
+}
+
+void GuidingTree::record(int leaf, const Vec& dir, float value) {
+  Leaf& l = leaves[size_t(leaf)];
+  l.building.record(dir, value);
+  l.samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+void GuidingTree::update() {
+  // Split the leaves that saw many samples; both halves start out with the
+  // parent's distributions.
+  size_t numNodes = nodes.size();
+  for (size_t i = 0; i < numNodes; ++i) {
+    Node n = nodes[i];
+    if (n.children[0] != 0 || n.depth >= MAX_DEPTH) {
+      continue;
+    }
+
+    Leaf& l = leaves[size_t(n.leaf)];
+    if (l.samples.load(std::memory_order_relaxed) < SPLIT_SAMPLES) {
+      continue;
+    }
+
+    int otherLeaf = int(leaves.size());
+    leaves.push_back(Leaf(leaves[size_t(n.leaf)]));
+
+    Node left;
+    left.children[0] = 0;
+    left.children[1] = 0;
+    left.leaf = n.leaf;
+    left.depth = n.depth + 1;
+
+    Node right = left;
+    right.leaf = otherLeaf;
+
+    nodes[i].children[0] = int(nodes.size());
+    nodes.push_back(left);
+    nodes[i].children[1] = int(nodes.size());
+    nodes.push_back(right);
+  }
+
+  // The radiance recorded this iteration becomes the sampling distribution
+  // for the next iteration.
+  parallel::parallel_for(0, int(leaves.size()), [&](int i) {
+    Leaf& l = leaves[size_t(i)];
+    l.sampling = l.building;
+    l.building.refine();
+    l.samples.store(0, std::memory_order_relaxed);
+  });
+}
+
+void GuidedPath::addVertex(
+  int leaf,
+  const Vec& dir,
+  const Vec& beta,
+  float pdf
+) {
+  if (numVertices == MAX_VERTICES) {
+    return;
+  }
+
+  Vertex& v = vertices[numVertices++];
+  v.leaf = leaf;
+  v.direction = dir;
+  v.beta = beta;
+  v.radiance = Vec(0, 0, 0);
+  v.pdf = pdf;
+}
+
+void GuidedPath::addRadiance(const Vec& L) {
+  for (int i = 0; i < numVertices; ++i) {
+    vertices[i].radiance += L;
+  }
+}
+
+void GuidedPath::commit(GuidingTree& tree) const {
+  for (int i = 0; i < numVertices; ++i) {
+    const Vertex& v = vertices[i];
+    if (v.pdf <= 0.0f || math::isNearlyZero(v.beta)) {
+      continue;
+    }
+
+    // The path radiance is weighted by the throughput up to the vertex;
+    // divide it out to get the radiance arriving at the vertex.
+    Vec incident(
+      v.beta[0] > 0.0f ? v.radiance[0] / v.beta[0] : 0.0f,
+      v.beta[1] > 0.0f ? v.radiance[1] / v.beta[1] : 0.0f,
+      v.beta[2] > 0.0f ? v.radiance[2] / v.beta[2] : 0.0f
+    );
+    float value = math::luminance(incident) / v.pdf;
+    if (value > 0.0f && std::isfinite(value)) {
+      tree.record(v.leaf, v.direction, value);
+    }
+  }
+}
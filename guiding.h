@@ -0,0 +1,235 @@
+#pragma once
+#include "core.h"
+#include "sampler.h"
+#include <atomic>
+#include <vector>
+
+class Geom;
+class Material;
+
+/**
+ * A distribution over the sphere of directions, stored as a quadtree over
+ * the cylindrical (cos theta, phi) parameterization, which is area-preserving.
+ * Each node stores the radiance recorded in each of its four quadrants, so
+ * the tree can be refined where most of the light comes from.
+ *
+ * Recording is thread-safe and lock-free; everything else is not.
+ */
+class DirectionalQuadtree {
+  /**
+   * The maximum number of levels in the tree.
+   */
+  static constexpr int MAX_DEPTH = 20;
+  /**
+   * The fraction of the total recorded radiance above which a quadrant is
+   * subdivided when the tree is refined.
+   */
+  static constexpr float SUBDIVIDE_FRACTION = 0.01f;
+
+  struct Node {
+    std::atomic<float> sums[4]; /**< The radiance recorded per quadrant. */
+    int children[4]; /**< The child node of each quadrant, or 0 if a leaf. */
+
+    Node();
+    Node(const Node& other);
+    Node& operator=(const Node& other);
+
+    /** The sum of the radiance recorded in all quadrants. */
+    float total() const;
+  };
+
+  std::vector<Node> nodes; /**< The nodes of the tree; the root comes first. */
+
+  /** Maps a world-space direction to the unit square. */
+  static Vec2 directionToSquare(const Vec& dir);
+
+  /** Maps a point in the unit square to a world-space direction. */
+  static Vec squareToDirection(const Vec2& p);
+
+public:
+  /** Constructs a tree with a single node and no recorded radiance. */
+  DirectionalQuadtree();
+
+  /**
+   * Adds radiance arriving from the given direction. This is thread-safe.
+   *
+   * @param dir   the world-space direction that the radiance arrives from
+   * @param value the amount of radiance (luminance, divided by the PDF of
+   *              sampling dir)
+   */
+  void record(const Vec& dir, float value);
+
+  /**
+   * Whether any radiance has been recorded, i.e. whether the tree describes
+   * a useful distribution.
+   */
+  bool hasData() const;
+
+  /**
+   * Samples a direction proportionally to the recorded radiance.
+   *
+   * @param sampler the per-thread sampler in use
+   * @returns        the sampled world-space direction
+   */
+  Vec sample(Sampler& sampler) const;
+
+  /**
+   * Returns the PDF (with respect to solid angle) of sampling the given
+   * world-space direction with DirectionalQuadtree::sample.
+   */
+  float pdf(const Vec& dir) const;
+
+  /**
+   * Rebuilds the structure of the tree from its recorded radiance, so that
+   * bright quadrants are subdivided and dark ones collapsed, and then clears
+   * the recorded radiance.
+   */
+  void refine();
+};
+
+/**
+ * A spatial-directional tree ("SD-tree") for path guiding. A binary tree
+ * subdivides the scene bounds, alternating between the X, Y, and Z axes, and
+ * each leaf holds two directional quadtrees: one that is sampled from during
+ * the current iteration, and one that records the radiance found during the
+ * current iteration and is used for sampling in the next.
+ *
+ * See Muller, Gross, and Novak, "Practical Path Guiding for Efficient
+ * Light-Transport Simulation" (2017).
+ */
+class GuidingTree {
+  /**
+   * The number of samples a leaf must record in an iteration before it is
+   * split in two.
+   */
+  static constexpr int SPLIT_SAMPLES = 12000;
+  /**
+   * The maximum depth of the spatial tree.
+   */
+  static constexpr int MAX_DEPTH = 32;
+
+  struct Leaf {
+    DirectionalQuadtree sampling; /**< Sampled from in this iteration. */
+    DirectionalQuadtree building; /**< Records radiance in this iteration. */
+    std::atomic<int> samples; /**< Number of records in this iteration. */
+
+    Leaf();
+    Leaf(const Leaf& other);
+  };
+
+  struct Node {
+    int children[2]; /**< The child nodes, or 0 if this node is a leaf. */
+    int leaf; /**< The index of the leaf, if this node is a leaf. */
+    int depth; /**< The depth of the node; determines the split axis. */
+  };
+
+  BBox bounds; /**< The bounds of the scene. */
+  std::vector<Node> nodes; /**< The nodes of the tree; the root comes first. */
+  std::vector<Leaf> leaves; /**< The leaves of the tree. */
+
+public:
+  /**
+   * The probability of sampling a guided direction rather than a BSDF
+   * direction at each vertex.
+   */
+  static constexpr float GUIDED_FRACTION = 0.5f;
+
+  /**
+   * Constructs a guiding tree with a single leaf covering the scene.
+   *
+   * @param objs the objects in the scene
+   */
+  GuidingTree(const std::vector<const Geom*>& objs);
+
+  /**
+   * Finds the leaf containing the given point.
+   *
+   * @param pos the point to look up
+   * @returns   the index of the leaf
+   */
+  int lookup(const Vec& pos) const;
+
+  /**
+   * Scatters a ray from an intersection by one-sample MIS between the BSDF
+   * and the guided distribution of the leaf containing the intersection.
+   * Until the leaf has been trained, only the BSDF is sampled. Same contract
+   * as Material::scatter.
+   *
+   * @param sampler            the per-thread sampler in use
+   * @param isect              the intersection information for the incoming
+   *                           ray
+   * @param leaf               the leaf containing the intersection
+   * @param rayOut    [out]    a ray to cast as a consequence
+   * @param betaInOut [in,out] the throughput, adjusted by the scattering
+   * @param pdfOut    [out]    the combined PDF of the sampled direction
+   */
+  void scatter(
+    Sampler& sampler,
+    const Intersection& isect,
+    int leaf,
+    Ray* rayOut,
+    Vec* betaInOut,
+    float* pdfOut
+  ) const;
+
+  /**
+   * Records radiance arriving at a point in a leaf. This is thread-safe.
+   *
+   * @param leaf  the leaf containing the point
+   * @param dir   the direction that the radiance arrives from
+   * @param value the amount of radiance (luminance, divided by the PDF of
+   *              sampling dir)
+   */
+  void record(int leaf, const Vec& dir, float value);
+
+  /**
+   * Prepares the tree for the next iteration: busy leaves are split, the
+   * recorded radiance becomes the new sampling distribution, and the
+   * recording trees are refined. The leaves are processed in parallel. This
+   * is NOT thread-safe with respect to sampling or recording.
+   */
+  void update();
+};
+
+/**
+ * Collects the guided vertices of a single path, so that the radiance found
+ * further along the path can be recorded into the guiding tree once the path
+ * is finished.
+ */
+class GuidedPath {
+  /** The maximum number of vertices per path that are recorded. */
+  static constexpr int MAX_VERTICES = 32;
+
+  struct Vertex {
+    int leaf; /**< The leaf containing the vertex. */
+    Vec direction; /**< The direction sampled at the vertex. */
+    Vec beta; /**< The path throughput after scattering at the vertex. */
+    Vec radiance; /**< The path radiance found after the vertex. */
+    float pdf; /**< The PDF of the sampled direction. */
+  };
+
+  Vertex vertices[MAX_VERTICES];
+  int numVertices;
+
+public:
+  GuidedPath() : numVertices(0) {}
+
+  /**
+   * Adds a vertex after scattering.
+   *
+   * @param leaf the leaf containing the vertex
+   * @param dir  the direction sampled at the vertex
+   * @param beta the path throughput after scattering at the vertex
+   * @param pdf  the PDF of sampling dir
+   */
+  void addVertex(int leaf, const Vec& dir, const Vec& beta, float pdf);
+
+  /**
+   * Adds radiance that was added to the path's total radiance to all of the
+   * vertices so far.
+   */
+  void addRadiance(const Vec& L);
+
+  /** Records the radiance arriving at each vertex into the tree. */
+  void commit(GuidingTree& tree) const;
+};
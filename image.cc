@@ -1,124 +1,516 @@
 #include "image.h"
+#include "denoiser.h"
+#include "parallel.h"
+#include <algorithm>
 #include <exception>
 #include <boost/algorithm/string.hpp>
-#include <boost/format.hpp>
 
-#define TINYEXR_IMPLEMENTATION
-#include <tinyexr.h>
-
-using boost::format;
+Image::TileBuffer::TileBuffer(const Tile& t, int apron, int w, int h, int p)
+  : tile(t),
+    apronX0(max(t.x0 - apron, 0)),
+    apronY0(max(t.y0 - apron, 0)),
+    apronX1(min(t.x1 + apron, w)),
+    apronY1(min(t.y1 + apron, h)),
+    planes(p),
+    sums(),
+    weightsX(size_t(2 * apron + 1))
+{
+  sums.assign(planeSize() * size_t(planes), 0);
+}
 
 Image::Image(int ww, int hh, int spp, float fw)
-  : currentIteration(boost::extents[hh][ww][spp]),
-    rawData(boost::extents[hh][ww]),
-    channelR(size_t(hh * ww)),
-    channelG(size_t(hh * ww)),
-    channelB(size_t(hh * ww)),
-    w(ww), h(hh), samplesPerPixel(spp), filterWidth(fw)
+  : pixelSums(boost::extents[hh][ww][PLANE_ALBEDO]),
+    stats(boost::extents[hh][ww]),
+    featureSums(boost::extents[hh][ww]),
+    featureOutput(false),
+    commitTiles(),
+    commitTilesX((ww + COMMIT_TILE_SIZE - 1) / COMMIT_TILE_SIZE),
+    commitTilesY((hh + COMMIT_TILE_SIZE - 1) / COMMIT_TILE_SIZE),
+    pendingAprons(),
+    apron(int(ceilf(2.0f * fw))),
+    filterTable(size_t(FILTER_TABLE_SIZE + 1)),
+    filterTableScale(float(FILTER_TABLE_SIZE) / fw),
+    filterCdf(size_t(FILTER_TABLE_SIZE + 1)),
+    filterSignRatio(1.0f),
+    filterSampling(false),
+    adaptiveThreshold(0.0f),
+    numActive(hh * ww),
+    samplesPerPixel(math::clampAny(spp, 1, MAX_SAMPLES_PER_PIXEL)),
+    w(ww), h(hh), filterWidth(fw)
 {
   // Clear the data array.
-  for (int y = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x) {
-      rawData[y][x] = Vec4(0, 0, 0, 0);
+  std::fill_n(pixelSums.data(), pixelSums.num_elements(), 0);
+
+  for (int i = 0; i <= FILTER_TABLE_SIZE; ++i) {
+    filterTable[size_t(i)] =
+      math::mitchellFilter(float(i) / float(FILTER_TABLE_SIZE));
+  }
+
+  // Integrate the filter and its magnitude with the trapezoid rule.
+  float signedIntegral = 0.0f;
+  filterCdf[0] = 0.0f;
+  for (size_t i = 1; i < filterCdf.size(); ++i) {
+    signedIntegral += 0.5f * (filterTable[i - 1] + filterTable[i]);
+    filterCdf[i] = filterCdf[i - 1]
+      + 0.5f * (fabsf(filterTable[i - 1]) + fabsf(filterTable[i]));
+  }
+
+  // The 2D filter is separable, so both of its integrals are squares.
+  float ratio = signedIntegral / filterCdf.back();
+  filterSignRatio = ratio * ratio;
+  for (float& c : filterCdf) {
+    c /= filterCdf.back();
+  }
+
+  for (int ty = 0; ty < commitTilesY; ++ty) {
+    for (int tx = 0; tx < commitTilesX; ++tx) {
+      CommitTile tile;
+      tile.x0 = tx * COMMIT_TILE_SIZE;
+      tile.y0 = ty * COMMIT_TILE_SIZE;
+      tile.x1 = min(tile.x0 + COMMIT_TILE_SIZE, w);
+      tile.y1 = min(tile.y0 + COMMIT_TILE_SIZE, h);
+      tile.numActive = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+      commitTiles.push_back(tile);
     }
   }
 }
 
+Image::TileBuffer Image::startTile(const Tile& tile) const {
+  return TileBuffer(tile, filterSampling ? 0 : apron, w, h, numPlanes());
+}
+
+void Image::setFilterImportanceSampling(bool enabled) {
+  filterSampling = enabled;
+}
+
+float Image::sampleFilterOffset(float u) const {
+  if (!filterSampling) {
+    return (2.0f * u - 1.0f) * filterWidth;
+  }
+
+  // The filter is symmetric, so fold u onto one half of it. This keeps the
+  // mapping monotonic, which preserves the stratification of u.
+  float v = 2.0f * u - 1.0f;
+  float target = fabsf(v);
+
+  // Invert the tabulated CDF, assuming a uniform density within an entry.
+  size_t i = size_t(
+    std::upper_bound(filterCdf.begin(), filterCdf.end(), target)
+      - filterCdf.begin()
+  );
+  i = math::clampAny(i, size_t(1), filterCdf.size() - 1);
+  float c0 = filterCdf[i - 1];
+  float c1 = filterCdf[i];
+  float t = c1 > c0 ? (target - c0) / (c1 - c0) : 0.0f;
+  float offset = (float(i - 1) + t) / float(FILTER_TABLE_SIZE) * filterWidth;
+
+  return v < 0.0f ? -offset : offset;
+}
+
 void Image::setSample(
+  TileBuffer& buffer,
   int x,
   int y,
   float ptX,
   float ptY,
-  int idx,
-  const Vec& color
+  const Vec& color,
+  const Features& features
 ) {
-  Sample& s = currentIteration[y][x][idx];
-  s.position = Vec2(ptX, ptY);
-  s.color = color;
+  PixelStats& ps = stats[y][x];
+  double lum = double(math::luminance(color));
+  ps.sum += lum;
+  ps.sumSquares += lum * lum;
+  ps.count++;
+
+  Features& fs = featureSums[y][x];
+  fs.albedo += features.albedo;
+  fs.normal += features.normal;
+  fs.depth += features.depth;
+
+  float values[NUM_PLANES];
+  values[PLANE_R] = color[0];
+  values[PLANE_G] = color[1];
+  values[PLANE_B] = color[2];
+  values[PLANE_WEIGHT] = 1.0f;
+  if (buffer.planes > PLANE_ALBEDO) {
+    for (int c = 0; c < 3; ++c) {
+      values[PLANE_ALBEDO + c] = features.albedo[c];
+      values[PLANE_NORMAL + c] = features.normal[c];
+      values[PLANE_POSITION + c] = features.position[c];
+    }
+    values[PLANE_DEPTH] = features.depth;
+  }
+
+  const size_t planeSize = buffer.planeSize();
+  const int stride = buffer.apronX1 - buffer.apronX0;
+
+  if (filterSampling) {
+    // The offset was drawn in proportion to the filter's magnitude, so the
+    // sample only counts toward its own pixel, with the filter's sign. The
+    // signs average out to filterSignRatio, so adding that to the weight
+    // instead keeps the estimate unbiased, and the weight sum positive.
+    bool negative = (filterWeight(ptX - float(x)) < 0.0f)
+      != (filterWeight(ptY - float(y)) < 0.0f);
+    float sign = negative ? -1.0f : 1.0f;
+
+    size_t i = size_t((y - buffer.apronY0) * stride + (x - buffer.apronX0));
+    for (int p = 0; p < buffer.planes; ++p) {
+      buffer.sums[size_t(p) * planeSize + i] +=
+        toFixed(p == PLANE_WEIGHT ? filterSignRatio : values[p] * sign);
+    }
+    return;
+  }
+
+  // The apron is wide enough for any sample of the tile's pixels, but clamp
+  // to it anyway so that a stray position cannot write out of bounds.
+  int minX = max(int(ceilf(ptX - filterWidth)), buffer.apronX0);
+  int maxX = min(int(floorf(ptX + filterWidth)), buffer.apronX1 - 1);
+  int minY = max(int(ceilf(ptY - filterWidth)), buffer.apronY0);
+  int maxY = min(int(floorf(ptY + filterWidth)), buffer.apronY1 - 1);
+
+  const int tapsX = maxX - minX + 1;
+  for (int i = 0; i < tapsX; ++i) {
+    buffer.weightsX[size_t(i)] = filterWeight(ptX - float(minX + i));
+  }
+
+  for (int yy = minY; yy <= maxY; ++yy) {
+    float weightY = filterWeight(ptY - float(yy));
+    size_t rowStart = size_t(
+      (yy - buffer.apronY0) * stride + (minX - buffer.apronX0)
+    );
+
+    for (int p = 0; p < buffer.planes; ++p) {
+      float value = values[p] * weightY;
+      int64_t* row = &buffer.sums[size_t(p) * planeSize + rowStart];
+      for (int i = 0; i < tapsX; ++i) {
+        row[i] += toFixed(value * buffer.weightsX[size_t(i)]);
+      }
+    }
+  }
+}
+
+void Image::finishTile(TileBuffer& buffer) {
+  const Tile& tile = buffer.tile;
+
+  // The tile's own pixels are not written by any other tile until the
+  // commit, so they can be added right away.
+  addSums(
+    buffer.sums.data(),
+    buffer.apronX0, buffer.apronY0, buffer.apronX1, buffer.apronY1,
+    tile.x0, tile.y0, tile.x1, tile.y1
+  );
+
+  // The apron is split into a strip above the tile, a strip below it, and
+  // the pieces to its left and right.
+  const int sides[4][4] = {
+    { buffer.apronX0, buffer.apronY0, buffer.apronX1, tile.y0 },
+    { buffer.apronX0, tile.y1, buffer.apronX1, buffer.apronY1 },
+    { buffer.apronX0, tile.y0, tile.x0, tile.y1 },
+    { tile.x1, tile.y0, buffer.apronX1, tile.y1 }
+  };
+
+  const size_t planeSize = buffer.planeSize();
+  const int stride = buffer.apronX1 - buffer.apronX0;
+  for (int side = 0; side < 4; ++side) {
+    ApronPart part;
+    part.x0 = sides[side][0];
+    part.y0 = sides[side][1];
+    part.x1 = sides[side][2];
+    part.y1 = sides[side][3];
+    if (part.x0 >= part.x1 || part.y0 >= part.y1) {
+      // The tile is at the edge of the image.
+      continue;
+    }
+
+    int partW = part.x1 - part.x0;
+    part.sums.reserve(size_t(partW * (part.y1 - part.y0) * buffer.planes));
+    for (int p = 0; p < buffer.planes; ++p) {
+      for (int y = part.y0; y < part.y1; ++y) {
+        const int64_t* row = &buffer.sums[size_t(p) * planeSize + size_t(
+          (y - buffer.apronY0) * stride + (part.x0 - buffer.apronX0)
+        )];
+        part.sums.insert(part.sums.end(), row, row + partW);
+      }
+    }
+
+    pendingAprons.push_back(std::move(part));
+  }
+}
+
+void Image::addSums(
+  const int64_t* sums,
+  int sumsX0,
+  int sumsY0,
+  int sumsX1,
+  int sumsY1,
+  int x0,
+  int y0,
+  int x1,
+  int y1
+) {
+  const int stride = sumsX1 - sumsX0;
+  const size_t planeSize = size_t(stride * (sumsY1 - sumsY0));
+  const int planes = numPlanes();
+
+  x0 = max(x0, sumsX0);
+  y0 = max(y0, sumsY0);
+  x1 = min(x1, sumsX1);
+  y1 = min(y1, sumsY1);
+
+  for (int y = y0; y < y1; ++y) {
+    for (int x = x0; x < x1; ++x) {
+      const int64_t* s = &sums[size_t((y - sumsY0) * stride + (x - sumsX0))];
+
+      int64_t* px = &pixelSums[y][x][0];
+      for (int p = 0; p < planes; ++p) {
+        px[p] += s[size_t(p) * planeSize];
+      }
+    }
+  }
+}
+
+void Image::setSamplesPerPixel(int spp) {
+  samplesPerPixel = math::clampAny(spp, 1, MAX_SAMPLES_PER_PIXEL);
+}
+
+void Image::setFeatureOutput(bool enabled) {
+  featureOutput = enabled;
+
+  // Resizing keeps the color planes, and clears any feature planes added.
+  pixelSums.resize(boost::extents[h][w][numPlanes()]);
+}
+
+float Image::meanError() const {
+  double sum = 0.0;
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      const PixelStats& ps = stats[y][x];
+      if (ps.count < 2) {
+        return math::VERY_BIG;
+      }
+
+      sum += double(ps.error);
+    }
+  }
+
+  return float(sum / double(w * h));
+}
+
+void Image::setAdaptiveThreshold(float threshold) {
+  adaptiveThreshold = threshold;
+}
+
+float Image::relativeError(const PixelStats& ps) {
+  if (ps.count < 2) {
+    return math::VERY_BIG;
+  }
+
+  double n = double(ps.count);
+  double mean = ps.sum / n;
+  double variance = max(0.0, (ps.sumSquares - n * mean * mean) / (n - 1.0));
+  double standardError = sqrt(variance / n);
+
+  return float(standardError / max(mean, double(ADAPTIVE_MIN_LUMINANCE)));
 }
 
 void Image::commitSamples() {
-  for (const auto& row : currentIteration) {
-    for (const auto& col : row) {
-      for (const Sample& s : col) {
-        float posX = s.position.x();
-        float posY = s.position.y();
-
-        int minX = math::clampAny(int(ceilf(posX - filterWidth)), 0, w - 1);
-        int maxX = math::clampAny(int(floorf(posX + filterWidth)), 0, w - 1);
-        int minY = math::clampAny(int(ceilf(posY - filterWidth)), 0, h - 1);
-        int maxY = math::clampAny(int(floorf(posY + filterWidth)), 0, h - 1);
-
-        for (int yy = minY; yy <= maxY; ++yy) {
-          for (int xx = minX; xx <= maxX; ++xx) {
-            Vec4& px = rawData[yy][xx];
-
-            float weight = math::mitchellFilter(
-              posX - float(xx),
-              posY - float(yy),
-              filterWidth
-            );
-
-            px[0] += s.color[0] * weight;
-            px[1] += s.color[1] * weight;
-            px[2] += s.color[2] * weight;
-            px[3] += weight;
-          }
-        }
+  // Hand each apron part to the blocks that it overlaps. The sums are in
+  // fixed point, so the order in which the tiles finished does not matter.
+  for (CommitTile& tile : commitTiles) {
+    tile.parts.clear();
+  }
+  for (const ApronPart& part : pendingAprons) {
+    for (int ty = part.y0 / COMMIT_TILE_SIZE;
+         ty <= (part.y1 - 1) / COMMIT_TILE_SIZE; ++ty) {
+      for (int tx = part.x0 / COMMIT_TILE_SIZE;
+           tx <= (part.x1 - 1) / COMMIT_TILE_SIZE; ++tx) {
+        commitTiles[size_t(ty * commitTilesX + tx)].parts.push_back(&part);
+      }
+    }
+  }
+
+  // Each block only writes its own pixels, so no locks are needed.
+  parallel::parallel_for(0, int(commitTiles.size()), [&](int i) {
+    resolveTile(commitTiles[size_t(i)]);
+  });
+
+  pendingAprons.clear();
+
+  numActive = 0;
+  for (const CommitTile& tile : commitTiles) {
+    numActive += tile.numActive;
+  }
+}
+
+void Image::resolveTile(CommitTile& tile) {
+  for (const ApronPart* part : tile.parts) {
+    addSums(
+      part->sums.data(),
+      part->x0, part->y0, part->x1, part->y1,
+      tile.x0, tile.y0, tile.x1, tile.y1
+    );
+  }
+
+  // Update the noise estimates and drop the pixels that have converged.
+  tile.numActive = 0;
+  for (int y = tile.y0; y < tile.y1; ++y) {
+    for (int x = tile.x0; x < tile.x1; ++x) {
+      PixelStats& ps = stats[y][x];
+      ps.error = relativeError(ps);
+
+      if (adaptiveThreshold > 0.0f && ps.active
+          && ps.count >= ADAPTIVE_MIN_SAMPLES
+          && ps.error < adaptiveThreshold) {
+        ps.active = false;
+      }
+
+      if (ps.active) {
+        tile.numActive++;
       }
     }
   }
 }
 
-void Image::writeToEXR(std::string fileName) {
+std::vector<Vec> Image::committedColors() const {
+  std::vector<Vec> color(size_t(h * w));
+  parallel::parallel_for(0, h, [&](int y) {
+    for (int x = 0; x < w; ++x) {
+      // Pixels without samples (or whose filter weights cancel out) stay
+      // black instead of dividing by zero.
+      // The fixed-point scale cancels out.
+      const int64_t* px = &pixelSums[y][x][0];
+      color[size_t(y * w + x)] = px[PLANE_WEIGHT] > 0
+        ? Vec(
+            Vec(float(px[PLANE_R]), float(px[PLANE_G]), float(px[PLANE_B]))
+              / float(px[PLANE_WEIGHT])
+          )
+        : Vec(0, 0, 0);
+    }
+  });
+  return color;
+}
+
+ExrFrame Image::snapshot() const {
+  return makeFrame(committedColors(), true);
+}
+
+ExrFrame Image::denoisedSnapshot() const {
+  std::vector<Vec> color = committedColors();
+  std::vector<float> variance(size_t(h * w));
+  std::vector<Features> features(size_t(h * w));
+
   for (int y = 0; y != h; ++y) {
     for (int x = 0; x != w; ++x) {
-      Vec4& px = rawData[y][x];
-
+      const PixelStats& ps = stats[y][x];
       size_t index = size_t(y * w + x);
-      channelR[index] = px.x() / px.w();
-      channelG[index] = px.y() / px.w();
-      channelB[index] = px.z() / px.w();
+
+      // The variance of the pixel's mean luminance.
+      if (ps.count >= 2) {
+        double n = double(ps.count);
+        double mean = ps.sum / n;
+        variance[index] = float(
+          max(0.0, (ps.sumSquares - n * mean * mean) / (n - 1.0)) / n
+        );
+      }
+
+      if (ps.count > 0) {
+        const Features& fs = featureSums[y][x];
+        float invCount = 1.0f / float(ps.count);
+        features[index].albedo = fs.albedo * invCount;
+        features[index].normal = fs.normal * invCount;
+        features[index].depth = fs.depth * invCount;
+      }
     }
   }
 
-  EXRImage image;
-  InitEXRImage(&image);
+  std::vector<Vec> denoised;
+  Denoiser(w, h).denoise(color, variance, features, &denoised);
+
+  return makeFrame(denoised, true);
+}
+
+ExrFrame Image::previewSnapshot(
+  int scale,
+  const std::vector<Vec>& blockColors
+) const {
+  std::vector<Vec> color(size_t(h * w));
+  int blocksW = (w + scale - 1) / scale;
+  for (int y = 0; y != h; ++y) {
+    for (int x = 0; x != w; ++x) {
+      color[size_t(y * w + x)] =
+        blockColors[size_t((y / scale) * blocksW + x / scale)];
+    }
+  }
 
-  constexpr unsigned numChannels = 3;
-  image.num_channels = numChannels;
+  return makeFrame(color, false);
+}
 
-  // Must be BGR(A) order, since most EXR viewers expect this channel order.
-  const char* channel_names[] = { "B", "G", "R" };
+ExrFrame Image::makeFrame(
+  const std::vector<Vec>& color,
+  bool withFeatures
+) const {
+  ExrFrame frame(w, h);
+  std::vector<float>& channelR = frame.addChannel("R", true);
+  std::vector<float>& channelG = frame.addChannel("G", true);
+  std::vector<float>& channelB = frame.addChannel("B", true);
+  for (size_t i = 0; i < color.size(); ++i) {
+    channelR[i] = color[i].x();
+    channelG[i] = color[i].y();
+    channelB[i] = color[i].z();
+  }
 
-  float* image_ptr[3] = {
-    channelB.data(), // B
-    channelG.data(), // G
-    channelR.data()  // R
-  };
+  // Only write the adaptive sampling maps if adaptive sampling is in use.
+  if (adaptiveThreshold > 0.0f) {
+    // Sample counts can exceed the range of half-floats.
+    std::vector<float>& channelError =
+      frame.addChannel("adaptive.error", false);
+    std::vector<float>& channelSamples =
+      frame.addChannel("adaptive.samples", false);
 
-  image.channel_names = channel_names;
-  image.images = reinterpret_cast<unsigned char**>(image_ptr);
-  image.width = w;
-  image.height = h;
-  image.compression = TINYEXR_COMPRESSIONTYPE_NONE;
+    for (int y = 0; y != h; ++y) {
+      for (int x = 0; x != w; ++x) {
+        const PixelStats& ps = stats[y][x];
 
-  image.pixel_types = new int[sizeof(int) * numChannels];
-  image.requested_pixel_types = new int[sizeof(int) * numChannels];
-  for (int i = 0; i < image.num_channels; i++) {
-    image.pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT; // pixel type of input image
-    image.requested_pixel_types[i] = TINYEXR_PIXELTYPE_HALF; // pixel type of output image to be stored in .EXR
+        size_t index = size_t(y * w + x);
+        channelError[index] = ps.error;
+        channelSamples[index] = float(ps.count);
+      }
+    }
   }
 
-  const char* err;
-  int ret = SaveMultiChannelEXRToFile(&image, fileName.c_str(), &err);
+  if (withFeatures && featureOutput) {
+    // Positions and depths need more precision than half-floats have.
+    const char* albedoNames[] = { "albedo.R", "albedo.G", "albedo.B" };
+    const char* normalNames[] = { "N.X", "N.Y", "N.Z" };
+    const char* positionNames[] = { "P.X", "P.Y", "P.Z" };
+    std::vector<float>* channelAlbedo[3];
+    std::vector<float>* channelNormal[3];
+    std::vector<float>* channelPosition[3];
+    for (int c = 0; c < 3; ++c) {
+      channelAlbedo[c] = &frame.addChannel(albedoNames[c], true);
+      channelNormal[c] = &frame.addChannel(normalNames[c], true);
+      channelPosition[c] = &frame.addChannel(positionNames[c], false);
+    }
+    std::vector<float>& channelDepth = frame.addChannel("Z", false);
 
-  delete[] image.pixel_types;
-  delete[] image.requested_pixel_types;
+    for (int y = 0; y != h; ++y) {
+      for (int x = 0; x != w; ++x) {
+        const int64_t* px = &pixelSums[y][x][0];
+        float invWeight = px[PLANE_WEIGHT] > 0
+          ? 1.0f / float(px[PLANE_WEIGHT])
+          : 0.0f;
 
-  if (ret != 0) {
-    throw std::runtime_error(
-      str(format("Error writing EXR file: '%1%'") % std::string(err))
-    );
+        size_t index = size_t(y * w + x);
+        for (int c = 0; c < 3; ++c) {
+          (*channelAlbedo[c])[index] = float(px[PLANE_ALBEDO + c]) * invWeight;
+          (*channelNormal[c])[index] = float(px[PLANE_NORMAL + c]) * invWeight;
+          (*channelPosition[c])[index] =
+            float(px[PLANE_POSITION + c]) * invWeight;
+        }
+        channelDepth[index] = float(px[PLANE_DEPTH]) * invWeight;
+      }
+    }
   }
+
+  return frame;
 }
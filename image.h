@@ -1,29 +1,292 @@
 #pragma once
 #include "math.h"
+#include "exrwriter.h"
+#include "parallel.h"
+#include "tiles.h"
 #include <boost/multi_array.hpp>
+#include <cstdint>
+#include <vector>
 
 class Image {
+public:
+  /**
+   * The surface seen by a sample at its first hit, which guides denoising
+   * and can be written out as feature AOVs. All zero if the sample hit
+   * nothing.
+   */
+  struct Features {
+    Vec albedo; /**< The reflectance of the material that was hit. */
+    Vec normal; /**< The surface normal at the hit. */
+    Vec position; /**< The point that was hit, in world space. */
+    float depth; /**< The distance from the camera to the hit. */
+
+    Features()
+      : albedo(0, 0, 0), normal(0, 0, 0), position(0, 0, 0), depth(0) {}
+  };
+
+  /**
+   * Filters the samples of one tile as they are set, into a private buffer
+   * that covers the tile and its apron (the pixels around it that the
+   * samples can reach). The buffer has one plane per quantity filtered,
+   * each in row-major order over the apron bounds, so that a row of filter
+   * taps touches a contiguous run of sums. With filter importance
+   * sampling, samples only count toward their own pixels, so the buffer has
+   * no apron. Get one from Image::startTile for each tile, and hand it back
+   * with Image::finishTile.
+   */
+  class TileBuffer {
+    friend class Image;
+
+    Tile tile; /**< The pixels whose samples are filtered. */
+    int apronX0; /**< The leftmost pixel column of the apron (inclusive). */
+    int apronY0; /**< The topmost pixel row of the apron (inclusive). */
+    int apronX1; /**< The rightmost pixel column of the apron (exclusive). */
+    int apronY1; /**< The bottommost pixel row of the apron (exclusive). */
+    int planes; /**< The number of planes in use. */
+    /** The filtered sums, plane by plane, in fixed point. */
+    std::vector<int64_t> sums;
+    std::vector<float> weightsX; /**< A sample's weights along each row. */
+
+    TileBuffer(const Tile& t, int apron, int w, int h, int p);
+
+    /** The number of sums in each plane of the buffer. */
+    inline size_t planeSize() const {
+      return size_t((apronX1 - apronX0) * (apronY1 - apronY0));
+    }
+  };
+
+private:
+  /**
+   * Running statistics of the (unfiltered) samples taken for a pixel, used
+   * to estimate how noisy the pixel still is.
+   */
+  struct PixelStats {
+    double sum; /**< The sum of the sample luminances. */
+    double sumSquares; /**< The sum of the squared sample luminances. */
+    int count; /**< The number of samples taken. */
+    float error; /**< The relative error as of the last commit. */
+    bool active; /**< Whether the pixel is sampled in the next iteration. */
+
+    PixelStats()
+      : sum(0), sumSquares(0), count(0), error(0), active(true) {}
+  };
 
-  struct Sample {
-    Vec2 position;
-    Vec color;
+  /**
+   * The quantities that a TileBuffer filters, each accumulated in its own
+   * plane. The feature planes are only used if feature output is enabled.
+   */
+  enum Plane {
+    PLANE_R,
+    PLANE_G,
+    PLANE_B,
+    PLANE_WEIGHT,
+    PLANE_ALBEDO, /**< The first of three planes. */
+    PLANE_NORMAL = PLANE_ALBEDO + 3, /**< The first of three planes. */
+    PLANE_POSITION = PLANE_NORMAL + 3, /**< The first of three planes. */
+    PLANE_DEPTH = PLANE_POSITION + 3,
+    NUM_PLANES
+  };
 
-    Sample() : position(0, 0), color(0, 0, 0) {}
+  /**
+   * A rectangle of a finished tile's apron, which lies over other tiles'
+   * pixels. It is kept until the next commit, when those tiles are no longer
+   * writing to their pixels. Its planes are laid out like those of a
+   * TileBuffer.
+   */
+  struct ApronPart {
+    int x0; /**< The leftmost pixel column (inclusive). */
+    int y0; /**< The topmost pixel row (inclusive). */
+    int x1; /**< The rightmost pixel column (exclusive). */
+    int y1; /**< The bottommost pixel row (exclusive). */
+    /** The filtered sums, plane by plane, in fixed point. */
+    std::vector<int64_t> sums;
+  };
+
+  /**
+   * A block of pixels whose apron parts are added, and whose noise
+   * estimates are updated, together by Image::commitSamples.
+   */
+  struct CommitTile {
+    int x0; /**< The leftmost pixel column of the block (inclusive). */
+    int y0; /**< The topmost pixel row of the block (inclusive). */
+    int x1; /**< The rightmost pixel column of the block (exclusive). */
+    int y1; /**< The bottommost pixel row of the block (exclusive). */
+    /** The apron parts that overlap the block. */
+    std::vector<const ApronPart*> parts;
+    int numActive; /**< The number of the block's pixels still active. */
   };
 
-  typedef boost::multi_array<Sample, 3> SampleArray;
-  typedef boost::multi_array<Vec4, 2> PixelArray;
+  /** The width and height of the blocks of a CommitTile. */
+  static constexpr int COMMIT_TILE_SIZE = 32;
+
+  /** The number of intervals that the filter weight table is split into. */
+  static constexpr int FILTER_TABLE_SIZE = 1024;
+
+  /**
+   * The scale of the fixed-point numbers that filtered samples are summed
+   * in: 2^24, the spacing of the smallest half-floats. Integer sums do not
+   * depend on the order of their terms, so neither does the image depend on
+   * how the tiles and their aprons group the samples.
+   */
+  static constexpr float FIXED_POINT_SCALE = 16777216.0f;
+
+  typedef boost::multi_array<int64_t, 3> SumArray;
+  typedef boost::multi_array<PixelStats, 2> StatsArray;
+  typedef boost::multi_array<Features, 2> FeatureArray;
+
+  /**
+   * The filtered sums of each pixel, in fixed point, with numPlanes() planes
+   * per pixel: the color and the weight, then the features if feature output
+   * is enabled.
+   */
+  SumArray pixelSums;
+
+  /** The per-pixel sample statistics for adaptive sampling. */
+  StatsArray stats;
+
+  /**
+   * The sums of the features of each pixel's samples; divided by the sample
+   * count in PixelStats, they give the pixel's mean features.
+   */
+  FeatureArray featureSums;
+
+  /** Whether the features are written as extra channels. */
+  bool featureOutput;
+
+  /**
+   * The blocks that Image::commitSamples splits the image into, in row-major
+   * order.
+   */
+  std::vector<CommitTile> commitTiles;
+  int commitTilesX; /**< The number of blocks per row. */
+  int commitTilesY; /**< The number of blocks per column. */
+
+  /** The apron parts of the tiles finished since the last commit. */
+  parallel::concurrent_vector<ApronPart> pendingAprons;
+
+  /**
+   * How far a sample can spread beyond its pixel, in pixels: the sample can
+   * be up to a filter width away from the pixel's center, and then splats
+   * up to another filter width further.
+   */
+  int apron;
+
+  /**
+   * The 1D Mitchell filter at FILTER_TABLE_SIZE + 1 evenly-spaced offsets
+   * from 0 to the filter width. The 2D filter is separable, so it is the
+   * product of two lookups.
+   */
+  std::vector<float> filterTable;
+
+  /** Converts an offset in pixels to an index into filterTable. */
+  float filterTableScale;
+
+  /**
+   * The cumulative distribution of the magnitude of the 1D Mitchell filter,
+   * at the same offsets as filterTable, normalized to end at 1. Used to
+   * draw sample offsets in proportion to the filter.
+   */
+  std::vector<float> filterCdf;
 
-  /** The samples from the current iteration. */
-  SampleArray currentIteration;
+  /**
+   * The integral of the 2D filter divided by the integral of its magnitude.
+   * This is the mean sign of the samples drawn by filter importance
+   * sampling, which each sample adds to its pixel's weight in place of its
+   * own sign, so that the weight sums never cancel out.
+   */
+  float filterSignRatio;
 
-  /** The raw sampled colors and weights. */
-  PixelArray rawData;
+  /**
+   * Whether sample offsets are drawn in proportion to the filter, so that
+   * each sample counts toward its own pixel only (see
+   * Image::setFilterImportanceSampling).
+   */
+  bool filterSampling;
+
+  /**
+   * The relative error below which a pixel stops being sampled. If <= 0,
+   * then adaptive sampling is disabled and every pixel is always sampled.
+   */
+  float adaptiveThreshold;
 
-  /** The array used for writing to an OpenEXR file. */
-  std::vector<float> channelR;
-  std::vector<float> channelG;
-  std::vector<float> channelB;
+  /** The number of pixels that are sampled in the next iteration. */
+  int numActive;
+
+  /** The number of samples per pixel in the current iteration. */
+  int samplesPerPixel;
+
+  /**
+   * Estimates the relative error (standard error of the mean divided by the
+   * mean) of a pixel from its sample statistics.
+   */
+  static float relativeError(const PixelStats& ps);
+
+  /** The number of planes accumulated for each sample. */
+  inline int numPlanes() const {
+    return featureOutput ? int(NUM_PLANES) : int(PLANE_ALBEDO);
+  }
+
+  /** Converts a filtered value to fixed point, rounding to nearest. */
+  static inline int64_t toFixed(float value) {
+    return int64_t(std::llrint(value * FIXED_POINT_SCALE));
+  }
+
+  /**
+   * Looks up the 1D filter weight of a sample at the given offset (in
+   * pixels) from a pixel's center, interpolating linearly between entries.
+   */
+  inline float filterWeight(float offset) const {
+    float t = std::min(fabsf(offset) * filterTableScale,
+      float(FILTER_TABLE_SIZE));
+    int i = std::min(int(t), FILTER_TABLE_SIZE - 1);
+    float a = filterTable[size_t(i)];
+    return a + (t - float(i)) * (filterTable[size_t(i + 1)] - a);
+  }
+
+  /**
+   * Adds a rectangle of filtered sums into the image, over the pixels that
+   * it shares with another rectangle.
+   *
+   * @param sums    the sums, plane by plane, each in row-major order
+   * @param sumsX0  the leftmost pixel column of the sums (inclusive)
+   * @param sumsY0  the topmost pixel row of the sums (inclusive)
+   * @param sumsX1  the rightmost pixel column of the sums (exclusive)
+   * @param sumsY1  the bottommost pixel row of the sums (exclusive)
+   * @param x0      the leftmost pixel column to add to (inclusive)
+   * @param y0      the topmost pixel row to add to (inclusive)
+   * @param x1      the rightmost pixel column to add to (exclusive)
+   * @param y1      the bottommost pixel row to add to (exclusive)
+   */
+  void addSums(
+    const int64_t* sums,
+    int sumsX0,
+    int sumsY0,
+    int sumsX1,
+    int sumsY1,
+    int x0,
+    int y0,
+    int x1,
+    int y1
+  );
+
+  /**
+   * Adds the apron parts that overlap a block into its pixels, and updates
+   * the block's noise estimates and active pixels.
+   */
+  void resolveTile(CommitTile& tile);
+
+  /**
+   * Creates a frame with the given color channels, plus the adaptive
+   * sampling maps if adaptive sampling is enabled.
+   *
+   * @param color        the color of each pixel, in row-major order
+   * @param withFeatures whether to also add the feature channels, if
+   *                     feature output is enabled
+   */
+  ExrFrame makeFrame(const std::vector<Vec>& color, bool withFeatures) const;
+
+  /** Returns the currently-committed color of each pixel. */
+  std::vector<Vec> committedColors() const;
 
 public:
   /**
@@ -36,9 +299,27 @@ public:
    */
   static constexpr int DEFAULT_SAMPLES_PER_PIXEL = 4;
 
+  /**
+   * The most samples per pixel that a single iteration may take, so that
+   * iterations planned from timings still end (and write the image) often.
+   */
+  static constexpr int MAX_SAMPLES_PER_PIXEL = 16;
+
+  /**
+   * The minimum number of samples that a pixel must have before adaptive
+   * sampling can consider it converged. Fewer samples make the variance
+   * estimate itself too noisy to trust.
+   */
+  static constexpr int ADAPTIVE_MIN_SAMPLES = 32;
+
+  /**
+   * The mean luminance below which errors are measured in absolute rather
+   * than relative terms, so that near-black pixels can still converge.
+   */
+  static constexpr float ADAPTIVE_MIN_LUMINANCE = 0.01f;
+
   const int w; /**< The width of the output image. */
   const int h; /**< The height of the output image. */
-  const int samplesPerPixel; /**< Samples per pixel per iteration. */
   const float filterWidth; /**< The width (radius) of the filter kernel. */
 
   /**
@@ -56,36 +337,165 @@ public:
     float fw = DEFAULT_FILTER_WIDTH
   );
 
+  /** The number of samples per pixel in the current iteration. */
+  inline int getSamplesPerPixel() const { return samplesPerPixel; }
+
   /**
-   * Sets the specified sample for the current iteration. The sample will
-   * not be applied to the image until Image::commitSamples is called.
-   * This is thread-safe if no two threads call this function with the same
-   * arguments (x, y, idx) at the same time. Otherwise, it is NOT thread-safe.
+   * Changes the number of samples per pixel taken in each iteration from now
+   * on. This must not be called while samples are being set.
    *
-   * @param x     the x-coordinate of the pixel for which the sample was taken
-   * @param y     the y-coordinate of the pixel for which the sample was taken
-   * @param ptX   the actual x-position of the sample, if jittered
-   * @param ptY   the actual y-position of the sample, if jittered
-   * @param idx   the index of the sample, 0 <= idx < samplesPerPixel
-   * @param color the color of the sample
+   * @param spp the number of samples per pixel, at least 1
+   */
+  void setSamplesPerPixel(int spp);
+
+  /**
+   * The mean relative error over all pixels, as of the last commit. This is
+   * math::VERY_BIG until every pixel has enough samples to estimate its
+   * error.
+   */
+  float meanError() const;
+
+  /**
+   * Chooses how samples are reconstructed. By default, sample offsets are
+   * uniform over the filter's support, and each sample is splatted into
+   * every pixel within reach of the filter, weighted by it. With filter
+   * importance sampling, offsets are instead drawn in proportion to the
+   * magnitude of the filter, and each sample only counts toward the pixel
+   * that it was taken for, with the sign of the filter (which has negative
+   * lobes). The sample adds the mean sign to the pixel's weight, rather than
+   * its own, so the result stays unbiased and the weight positive. This
+   * makes reconstruction a single add per sample, at the cost of slightly
+   * more noise. This must only be called before the first tile is started.
+   *
+   * See Ernst et al., "Filter Importance Sampling" (2006).
+   *
+   * @param enabled whether to importance sample the filter
+   */
+  void setFilterImportanceSampling(bool enabled);
+
+  /**
+   * Maps a uniform value to the offset of a sample from its pixel's center
+   * along one axis, according to the reconstruction mode.
+   *
+   * @param u a value in [0, 1)
+   * @returns the offset in pixels, in [-filterWidth, filterWidth]
+   */
+  float sampleFilterOffset(float u) const;
+
+  /**
+   * Enables adaptive sampling: once a pixel's relative error falls below the
+   * threshold, it is no longer sampled in later iterations.
+   *
+   * @param threshold the target relative error; if <= 0, then adaptive
+   *                  sampling is disabled
+   */
+  void setAdaptiveThreshold(float threshold);
+
+  /**
+   * Enables reconstructing each sample's first-hit features with the same
+   * filter as its color, and writing them as extra channels of the OpenEXR
+   * output: "albedo.R", "albedo.G", "albedo.B", "N.X", "N.Y", "N.Z", "P.X",
+   * "P.Y", "P.Z", and "Z" (the depth). This must only be called before the
+   * first tile is started or right after a commit; only samples set
+   * afterwards contribute.
+   *
+   * @param enabled whether to write the features
+   */
+  void setFeatureOutput(bool enabled);
+
+  /**
+   * Whether the pixel should be sampled in the current iteration. Pixels that
+   * are not active must not be given samples.
+   */
+  inline bool isPixelActive(int x, int y) const {
+    return stats[y][x].active;
+  }
+
+  /** The number of pixels that are sampled in the current iteration. */
+  inline int activePixelCount() const { return numActive; }
+
+  /**
+   * Starts filtering the samples of a tile for the current iteration. The
+   * tiles of an iteration must not overlap.
+   *
+   * @param tile the pixels whose samples will be set
+   * @returns    an empty buffer for the tile's samples
+   */
+  TileBuffer startTile(const Tile& tile) const;
+
+  /**
+   * Filters a sample into a tile's buffer. The sample will not be applied
+   * to the image until the tile is finished, and not completely until
+   * Image::commitSamples is called. This is thread-safe as long as no two
+   * threads use the same buffer at the same time.
+   *
+   * @param buffer   the buffer of the tile that contains the pixel
+   * @param x        the x-coordinate of the pixel for which the sample was
+   *                 taken
+   * @param y        the y-coordinate of the pixel for which the sample was
+   *                 taken
+   * @param ptX      the actual x-position of the sample, if jittered
+   * @param ptY      the actual y-position of the sample, if jittered
+   * @param color    the color of the sample
+   * @param features the surface seen by the sample at its first hit
    */
   void setSample(
+    TileBuffer& buffer,
     int x,
     int y,
     float ptX,
     float ptY,
-    int idx,
-    const Vec& color
+    const Vec& color,
+    const Features& features
   );
 
   /**
-   * Takes the currently-set samples, filters their values, and adds them to
-   * the image. This is NOT thread-safe.
+   * Adds a tile's filtered samples to its own pixels, and keeps the rest
+   * (its apron) for Image::commitSamples. This is thread-safe, as long as
+   * the image's tiles do not overlap.
+   *
+   * @param buffer the buffer of the tile; it must not be used afterwards
+   */
+  void finishTile(TileBuffer& buffer);
+
+  /**
+   * Adds the aprons of the tiles finished since the last commit to the
+   * image, which completes the filtering of their samples. If adaptive
+   * sampling is enabled, this also decides which pixels are active in the
+   * next iteration. The work is spread over all cores, without locks, and
+   * the result does not depend on the order in which the tiles finished.
+   * This must not be called while samples are being set, and is NOT
+   * thread-safe.
    */
   void commitSamples();
 
   /**
-   * Writes the currently-committed image to an OpenEXR file on disk.
+   * Takes a snapshot of the currently-committed image, to be written to an
+   * OpenEXR file. If adaptive sampling is enabled, the per-pixel relative
+   * error and sample count are added as the extra channels "adaptive.error"
+   * and "adaptive.samples". If feature output is enabled, the features are
+   * added too (see Image::setFeatureOutput).
+   */
+  ExrFrame snapshot() const;
+
+  /**
+   * Denoises the currently-committed image (see Denoiser), guided by the
+   * mean features and the noise estimate of each pixel, and returns the
+   * result with the same extra channels as Image::snapshot. The image
+   * itself is left unchanged.
+   */
+  ExrFrame denoisedSnapshot() const;
+
+  /**
+   * Returns a low-resolution preview, upsampling each block of pixels from a
+   * single color.
+   *
+   * @param scale       the width and height of each block, in pixels
+   * @param blockColors the color of each block, in row-major order with
+   *                    ceil(w / scale) blocks per row
    */
-  void writeToEXR(std::string fileName);
+  ExrFrame previewSnapshot(
+    int scale,
+    const std::vector<Vec>& blockColors
+  ) const;
 };
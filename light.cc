@@ -1,26 +1,46 @@
 #include "light.h"
 #include "accelerator.h"
+#include "shadowqueue.h"
 
 AreaLight::AreaLight(const Vec& c) : color(c) {}
 
 AreaLight::AreaLight(const Node& n) : AreaLight(n.getVec("color")) {}
 
+/**
+ * Makes the shadow ray from a point towards a light at the given distance.
+ * The ray is offset from the point so that it doesn't hit the surface it
+ * starts on, and stops short of the light so that it doesn't hit the light.
+ */
+static inline void makeShadowRay(
+  const Vec& point,
+  const Vec& dirToLight,
+  float dist,
+  Ray* shadowRayOut,
+  float* shadowDistOut
+) {
+  *shadowRayOut = Ray(point + math::VERY_SMALL * dirToLight, dirToLight);
+  *shadowDistOut = dist - 3.0f * math::VERY_SMALL;
+}
+
 inline Vec AreaLight::directIlluminateByLightPDF(
-  Randomness& rng,
+  Sampler& sampler,
   const Intersection& isect,
   const Geom* emissionObj,
-  const Accelerator* accel
+  float pickPdf,
+  Ray* shadowRayOut,
+  float* shadowDistOut
 ) const {
   // Sample random from light PDF.
   Vec outgoingWorld;
+  float lightDist;
   Vec lightColor;
   float lightPdf;
   sampleLight(
-    rng,
-    accel,
+    sampler,
     emissionObj,
     isect.position,
     &outgoingWorld,
+    &lightDist,
     &lightColor,
     &lightPdf
   );
@@ -38,7 +58,12 @@ inline Vec AreaLight::directIlluminateByLightPDF(
     );
 
     if (bsdfPdf > 0.0f && !math::isVectorExactlyZero(bsdf)) {
-      float lightWeight = math::powerHeuristic(1, lightPdf, 1, bsdfPdf);
+      makeShadowRay(
+        isect.position, outgoingWorld, lightDist, shadowRayOut, shadowDistOut
+      );
+
+      float lightWeight =
+        math::powerHeuristic(1, pickPdf * lightPdf, 1, bsdfPdf);
       return bsdf.cwiseProduct(lightColor)
         * fabsf(isect.normal.dot(outgoingWorld))
         * lightWeight / lightPdf;
@@ -49,10 +74,12 @@ inline Vec AreaLight::directIlluminateByLightPDF(
 }
 
 inline Vec AreaLight::directIlluminateByMatPDF(
-  Randomness& rng,
+  Sampler& sampler,
   const Intersection& isect,
   const Geom* emissionObj,
-  const Accelerator* accel
+  const Accelerator* accel,
+  Ray* shadowRayOut,
+  float* shadowDistOut
 ) const {
   // Sample random from BSDF PDF.
   Vec outgoingWorld;
@@ -60,7 +87,7 @@ inline Vec AreaLight::directIlluminateByMatPDF(
   float bsdfPdf;
   isect.geom->mat->sampleWorld(
     isect,
-    rng,
+    sampler,
     -isect.incomingRay.direction,
     &outgoingWorld,
     &bsdf,
@@ -69,18 +96,29 @@ inline Vec AreaLight::directIlluminateByMatPDF(
 
   if (bsdfPdf > 0.0f && !math::isVectorExactlyZero(bsdf)) {
     // Evaluate light PDF as well.
+    float lightDist;
     Vec lightColor;
     float lightPdf;
     evalLight(
-      accel,
       emissionObj,
       isect.position,
       outgoingWorld,
+      &lightDist,
       &lightColor,
-      &lightPdf
+      &lightPdf,
+      accel
     );
 
     if (lightPdf > 0.0f && !math::isVectorExactlyZero(lightColor)) {
+      if (accel) {
+        // Visibility is already accounted for.
+        *shadowDistOut = 0.0f;
+      } else {
+        makeShadowRay(
+          isect.position, outgoingWorld, lightDist, shadowRayOut, shadowDistOut
+        );
+      }
+
       float bsdfWeight = math::powerHeuristic(1, bsdfPdf, 1, lightPdf);
       return bsdf.cwiseProduct(lightColor)
         * fabsf(isect.normal.dot(outgoingWorld))
@@ -103,136 +141,137 @@ Vec AreaLight::emit(
   return color;
 }
 
-Vec AreaLight::emit(
-  const Ray& incoming,
-  const Intersection& isect,
-  const Accelerator* accel
-) const {
-  // Only emit on the normal-facing side of objects, e.g. on the outside of a
-  // sphere or on the normal side of a disc.
-  if (incoming.direction.dot(isect.normal) > 0.0f) {
-    return Vec(0, 0, 0);
-  }
-
-  // Object might be occluded behind another object.
-  float dist = isect.distance - 2.0f * math::VERY_SMALL;
-  if (accel->intersectShadow(incoming, dist)) {
-    return Vec(0, 0, 0);
-  }
-
-  return color;
-}
-
 void AreaLight::evalLight(
-  const Accelerator* accel,
   const Geom* emissionObj,
   const Vec& point,
   const Vec& dirToLight,
+  float* distOut,
   Vec* colorOut,
-  float* pdfOut
+  float* pdfOut,
+  const Accelerator* accel
 ) const {
-  float pdf;
-  Vec emittedColor;
-
-  BSphere emitterBounds = emissionObj->boundSphere();
-  if (emitterBounds.contains(point)) {
-    // We're inside the bounding sphere, so sample sphere uniformly.
-    pdf = math::uniformSampleSpherePDF();
-  } else {
-    // We're outside the bounding sphere, so sample by solid angle.
-    Vec dirToLightOrigin = emitterBounds.origin - point;
-    float theta = asinf(emitterBounds.radius / dirToLightOrigin.norm());
-
-    Vec normal = dirToLightOrigin.normalized();
-    Vec tangent;
-    Vec binormal;
-    math::coordSystem(normal, &tangent, &binormal);
-
-    Vec dirToLightLocal =
-      math::worldToLocal(dirToLight, tangent, binormal, normal);
-    pdf = math::uniformSampleConePDF(theta, dirToLightLocal);
-  }
-
   Ray pointToLight(point + math::VERY_SMALL * dirToLight, dirToLight);
   Intersection lightIsect;
-  if (!emissionObj->intersect(pointToLight, &lightIsect)) {
-    // No emission if the ray doesn't hit the light
-    // (e.g. sampling doesn't exactly correspond with light).
-    emittedColor = Vec(0, 0, 0);
-  } else {
-    // Emits color if the ray does hit the light.
-    emittedColor = emit(pointToLight, lightIsect, accel);
+  bool hit = accel
+    ? accel->intersectFirst(pointToLight, emissionObj, &lightIsect)
+    : emissionObj->intersect(pointToLight, &lightIsect);
+  if (!hit) {
+    // No emission if the ray doesn't hit the light (or, with an accelerator,
+    // if something else is in the way), so the PDF doesn't matter either.
+    *distOut = 0.0f;
+    *colorOut = Vec(0, 0, 0);
+    *pdfOut = 0.0f;
+    return;
   }
 
-  *colorOut = emittedColor;
-  *pdfOut = pdf;
+  // Emits color if the ray does hit the light.
+  *distOut = lightIsect.distance + math::VERY_SMALL;
+  *colorOut = emit(lightIsect);
+  *pdfOut = emissionObj->samplePointPDF(point, lightIsect);
 }
 
 void AreaLight::sampleLight(
-  Randomness& rng,
-  const Accelerator* accel,
+  Sampler& sampler,
   const Geom* emissionObj,
   const Vec& point,
   Vec* dirToLightOut,
+  float* distOut,
   Vec* colorOut,
   float* pdfOut
 ) const {
-  Vec dirToLight;
+  Vec lightPos;
+  Vec lightNormal;
   float pdf;
-  Vec emittedColor;
-
-  BSphere emitterBounds = emissionObj->boundSphere();
-  if (emitterBounds.contains(point)) {
-    // We're inside the bounding sphere, so sample sphere uniformly.
-    dirToLight = math::uniformSampleSphere(rng);
-    pdf = math::uniformSampleSpherePDF();
-  } else {
-    // We're outside the bounding sphere, so sample by solid angle.
-    Vec dirToLightOrigin = emitterBounds.origin - point;
-    float theta = asinf(emitterBounds.radius / dirToLightOrigin.norm());
-
-    Vec normal = dirToLightOrigin.normalized();
-    Vec tangent;
-    Vec binormal;
-    math::coordSystem(normal, &tangent, &binormal);
-
-    dirToLight = math::localToWorld(
-      math::uniformSampleCone(rng, theta),
-      tangent,
-      binormal,
-      normal
-    );
-    pdf = math::uniformSampleConePDF(theta);
+  if (!emissionObj->samplePoint(
+        sampler, point, &lightPos, &lightNormal, &pdf)) {
+    *dirToLightOut = Vec(0, 0, 1);
+    *distOut = 0.0f;
+    *colorOut = Vec(0, 0, 0);
+    *pdfOut = 0.0f;
+    return;
   }
 
-  Ray pointToLight(point + math::VERY_SMALL * dirToLight, dirToLight);
-  Intersection lightIsect;
-  if (!emissionObj->intersect(pointToLight, &lightIsect)) {
-    // No emission if the ray doesn't hit the light
-    // (e.g. sampling doesn't exactly correspond with light).
-    emittedColor = Vec(0, 0, 0);
-  } else {
-    // Emits color if the ray does hit the light.
-    emittedColor = emit(pointToLight, lightIsect, accel);
-  }
+  Vec toLight = lightPos - point;
+  float dist = toLight.norm();
+  Vec dirToLight = toLight / dist;
+  Intersection lightIsect(
+    lightPos,
+    lightNormal,
+    Ray(point, dirToLight),
+    emissionObj,
+    dist
+  );
 
   *dirToLightOut = dirToLight;
-  *colorOut = emittedColor;
+  *distOut = dist;
+  *colorOut = emit(lightIsect);
   *pdfOut = pdf;
 }
 
 Vec AreaLight::directIlluminate(
-  Randomness& rng,
+  Sampler& sampler,
   const Intersection& isect,
   const Geom* emissionObj,
-  const Accelerator* accel
+  const Accelerator* accel,
+  bool sampleMat,
+  float pickPdf
 ) const {
   Vec Ld(0, 0, 0);
+  Ray shadowRay;
+  float shadowDist;
 
-  Ld +=
-    directIlluminateByLightPDF(rng, isect, emissionObj, accel);
-  Ld +=
-    directIlluminateByMatPDF(rng, isect, emissionObj, accel);
+  Vec byLight = directIlluminateByLightPDF(
+    sampler, isect, emissionObj, sampleMat ? 1.0f : pickPdf,
+    &shadowRay, &shadowDist
+  );
+  if (!math::isVectorExactlyZero(byLight)
+      && !accel->intersectShadow(shadowRay, shadowDist)) {
+    Ld += byLight;
+  }
+
+  if (!sampleMat) {
+    return Ld;
+  }
+
+  // The fused visibility query already accounts for occlusion.
+  Ld += directIlluminateByMatPDF(
+    sampler, isect, emissionObj, accel, &shadowRay, &shadowDist
+  );
 
   return Ld;
 }
+
+void AreaLight::directIlluminateDeferred(
+  Sampler& sampler,
+  const Intersection& isect,
+  const Geom* emissionObj,
+  const Vec& scale,
+  size_t owner,
+  ShadowQueue* queue,
+  bool sampleMat,
+  float pickPdf
+) const {
+  Ray shadowRay;
+  float shadowDist;
+
+  Vec byLight = directIlluminateByLightPDF(
+    sampler, isect, emissionObj, sampleMat ? 1.0f : pickPdf,
+    &shadowRay, &shadowDist
+  );
+  if (!math::isVectorExactlyZero(byLight)) {
+    queue->push(owner, shadowRay, shadowDist, scale.cwiseProduct(byLight));
+  }
+
+  if (!sampleMat) {
+    return;
+  }
+
+  // Only intersect the emitter here, so that the occlusion test can be
+  // batched with the others.
+  Vec byMat = directIlluminateByMatPDF(
+    sampler, isect, emissionObj, nullptr, &shadowRay, &shadowDist
+  );
+  if (!math::isVectorExactlyZero(byMat)) {
+    queue->push(owner, shadowRay, shadowDist, scale.cwiseProduct(byMat));
+  }
+}
@@ -5,6 +5,7 @@
 #include "node.h"
 
 class Accelerator;
+class ShadowQueue;
 
 /**
  * A diffuse area light that causes radiance to be emitted from a piece of
@@ -15,29 +16,46 @@ private:
   /**
    * Helper function for AreaLight::directIlluminate.
    * Calculates only the weighted component of direct illumination according
-   * to the light's PDF.
-   * For help on parameters, see the documentation for
+   * to the light's PDF, assuming that the light is not occluded.
+   * For help on the other parameters, see the documentation for
    * AreaLight::directIlluminate.
+   *
+   * @param pickPdf             the probability that the emitter was picked,
+   *                            which the MIS weight takes into account
+   * @param shadowRayOut  [out] the ray that must be unoccluded for the
+   *                            illumination to arrive
+   * @param shadowDistOut [out] the distance along the shadow ray that must be
+   *                            unoccluded, or 0 if there is nothing to test
+   * @returns                   the unoccluded illumination; if it is zero,
+   *                            then the shadow ray need not be tested
    */
   inline Vec directIlluminateByLightPDF(
-    Randomness& rng,
+    Sampler& sampler,
     const Intersection& isect,
     const Geom* emitter,
-    const Accelerator* accel
+    float pickPdf,
+    Ray* shadowRayOut,
+    float* shadowDistOut
   ) const;
 
   /**
    * Helper function for AreaLight::directIlluminate.
    * Calculates only the weighted component of direct illumination according
-   * to the material's PDF.
+   * to the material's PDF, assuming that the light is not occluded.
    * For help on parameters, see the documentation for
-   * AreaLight::directIlluminate.
+   * AreaLight::directIlluminateByLightPDF. (The MIS weight assumes that the
+   * emitter was picked for certain.)
+   *
+   * If an accelerator is given, then the visibility of the light is resolved
+   * right away by AreaLight::evalLight, and there is no shadow ray to test.
    */
   inline Vec directIlluminateByMatPDF(
-    Randomness& rng,
+    Sampler& sampler,
     const Intersection& isect,
     const Geom* emitter,
-    const Accelerator* accel
+    const Accelerator* accel,
+    Ray* shadowRayOut,
+    float* shadowDistOut
   ) const;
 
 public:
@@ -56,52 +74,62 @@ public:
   /**
    * Evaluates the emittance from an emission object onto a given point via
    * a specified direction. (Note that a diffuse area light can illuminate a
-   * point from multiple different directions.)
+   * point from multiple different directions.) If an accelerator is given,
+   * then occlusion by other objects is taken into account in the same
+   * traversal (see Accelerator::intersectFirst); otherwise it is ignored.
    *
-   * @param accel                the accelerator containing the scene geometry
    * @param emitter              the geometry from which light is emitted
    * @param point                the world-space point being illuminated by the
    *                             emitter
    * @param dirToLight           the direction from the world-space point
    *                             towards the light for which illumination
    *                             should be calculated
+   * @param distOut        [out] the distance from the point to the emitter
+   *                             along dirToLight
    * @param colorOut       [out] the color the light emits
    * @param pdfOut         [out] the probability that the light-sampling routine
-   *                             Material::sampleLight would have chosen the
+   *                             AreaLight::sampleLight would have chosen the
    *                             direction dirToLight to illuminate the
-   *                             world-space point
+   *                             world-space point, or 0 if the direction
+   *                             misses the emitter (or is occluded)
+   * @param accel                if not null, the accelerator containing the
+   *                             scene geometry, used to test occlusion
    */
   void evalLight(
-    const Accelerator* accel,
     const Geom* emitter,
     const Vec& point,
     const Vec& dirToLight,
+    float* distOut,
     Vec* colorOut,
-    float* pdfOut
+    float* pdfOut,
+    const Accelerator* accel = nullptr
   ) const;
 
   /**
    * Samples the emittance from the emission object onto a given point via a
-   * randomly-chosen direction. (Note that a diffuse area light can illuminate a
-   * point from multiple different directions.)
+   * randomly-chosen direction, ignoring occlusion by other objects. (Note that
+   * a diffuse area light can illuminate a point from multiple different
+   * directions.) The direction is picked by sampling a point on the emitter
+   * with Geom::samplePoint.
    *
-   * @param rng                  the per-thread RNG in use
-   * @param accel                the accelerator containing the scene geometry
+   * @param sampler              the per-thread sampler in use
    * @param emitter              the geometry from which light is emitted
    * @param point                the world-space point being illuminated by the
    *                             emitter
    * @param dirToLightOut  [out] the randomly-sampled direction from the point
    *                             towards the emission object
+   * @param distOut        [out] the distance from the point to the emitter
+   *                             along dirToLightOut
    * @param colorOut       [out] the color the light emits
    * @param pdfOut         [out] the probability of choosing the direction
    *                             dirToLight
    */
   void sampleLight(
-    Randomness& rng,
-    const Accelerator* accel,
+    Sampler& sampler,
     const Geom* emitter,
     const Vec& point,
     Vec* dirToLightOut,
+    float* distOut,
     Vec* colorOut,
     float* pdfOut
   ) const;
@@ -118,35 +146,60 @@ public:
   ) const;
 
   /**
-   * Calculates the emittance of the area light via a given ray intersection on
-   * the light, taking into account occlusion by other objects.
+   * Computes the direct illumination from a random point on a piece of solid
+   * geometry (the emitter) onto another piece of geometry (the reflector) at
+   * the specified intersection point.
    *
-   * @param incoming     the incoming ray that struck the surface
-   * @param isect        the intersection information for the incoming ray
-   * @param accel        the accelerator containing the scene geometry
-   * @returns            the emittance from the light
+   * Normally, both the light and the material are sampled for a direction,
+   * and the two samples are combined with MIS. If sampleMat is false, then
+   * only the light is sampled, and it is weighted against the BSDF sample
+   * that the path itself takes to continue; that sample can hit any emitter,
+   * so the weight accounts for the probability of picking this one.
+   *
+   * @param sampler         the per-thread sampler in use
+   * @param isect           the intersection on the target geometry that should
+   *                        be illuminated
+   * @param emitter         the object doing the illuminating (the emitter)
+   * @param accel           the accelerator containing the scene geometry
+   * @param sampleMat       whether to also sample the material for a direction
+   * @param pickPdf         the probability that the emitter was picked; only
+   *                        used if sampleMat is false
    */
-  Vec emit(
-    const Ray& incoming,
+  Vec directIlluminate(
+    Sampler& sampler,
     const Intersection& isect,
-    const Accelerator* accel
+    const Geom* emitter,
+    const Accelerator* accel,
+    bool sampleMat = true,
+    float pickPdf = 1.0f
   ) const;
 
   /**
-   * Computes the direct illumination from a random point on a piece of solid
-   * geometry (the emitter) onto another piece of geometry (the reflector) at
-   * the specified intersection point.
+   * Like AreaLight::directIlluminate, but instead of testing for occlusion
+   * right away, queues the shadow rays along with the illumination that each
+   * would add. The illumination is only added once the queue is flushed.
    *
-   * @param rng             the per-thread RNG in use
+   * @param sampler         the per-thread sampler in use
    * @param isect           the intersection on the target geometry that should
    *                        be illuminated
    * @param emitter         the object doing the illuminating (the emitter)
-   * @param accel           the accelerator containing the scene geometry
+   * @param scale           the factor to multiply the illumination by, e.g.
+   *                        the path throughput
+   * @param owner           the index passed back with the illumination when
+   *                        the queue is flushed
+   * @param queue           the queue that receives the shadow rays
+   * @param sampleMat       whether to also sample the material for a direction
+   * @param pickPdf         the probability that the emitter was picked; only
+   *                        used if sampleMat is false
    */
-  Vec directIlluminate(
-    Randomness& rng,
+  void directIlluminateDeferred(
+    Sampler& sampler,
     const Intersection& isect,
     const Geom* emitter,
-    const Accelerator* accel
+    const Vec& scale,
+    size_t owner,
+    ShadowQueue* queue,
+    bool sampleMat = true,
+    float pickPdf = 1.0f
   ) const;
 };
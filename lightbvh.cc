@@ -0,0 +1,182 @@
+#include "lightbvh.h"
+#include "geom.h"
+#include "light.h"
+#include <algorithm>
+
+LightBVH::LightBVH() : nodes(), leaves() {}
+
+LightBVH::LightBVH(const std::vector<const Geom*>& emitters)
+  : nodes(), leaves()
+{
+  std::vector<BuildItem> items;
+  for (size_t i = 0; i < emitters.size(); ++i) {
+    const Geom* g = emitters[i];
+    float power = g->area() * math::luminance(g->light->color);
+    if (power <= 0.0f) {
+      continue;
+    }
+
+    BuildItem item;
+    item.emitter = i;
+    item.bounds = g->boundBox();
+    item.centroid = (item.bounds.lower + item.bounds.upper) * 0.5f;
+    item.cone = g->normalCone();
+    item.power = power;
+    items.push_back(item);
+  }
+
+  if (!items.empty()) {
+    nodes.reserve(2 * items.size() - 1);
+    build(items, 0, items.size(), -1);
+  }
+
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (nodes[i].secondChild < 0) {
+      leaves[emitters[nodes[i].emitter]] = i;
+    }
+  }
+}
+
+int LightBVH::build(
+  std::vector<BuildItem>& items,
+  size_t start,
+  size_t end,
+  int parent
+) {
+  Node n;
+  n.bounds = items[start].bounds;
+  n.cone = items[start].cone;
+  n.power = items[start].power;
+  n.parent = parent;
+  n.secondChild = -1;
+  n.emitter = items[start].emitter;
+
+  BBox centroidBounds(items[start].centroid, items[start].centroid);
+  for (size_t i = start + 1; i < end; ++i) {
+    n.bounds.expand(items[i].bounds);
+    n.cone.expand(items[i].cone);
+    n.power += items[i].power;
+    centroidBounds.expand(items[i].centroid);
+  }
+
+  int index = int(nodes.size());
+  nodes.push_back(n);
+  if (end - start == 1) {
+    return index;
+  }
+
+  // Split at the median centroid along the longest axis.
+  int axis = centroidBounds.maximumExtent();
+  size_t mid = (start + end) / 2;
+  std::nth_element(
+    items.begin() + long(start),
+    items.begin() + long(mid),
+    items.begin() + long(end),
+    [axis](const BuildItem& a, const BuildItem& b) {
+      return a.centroid[axis] < b.centroid[axis];
+    }
+  );
+
+  build(items, start, mid, index);
+  nodes[size_t(index)].secondChild = build(items, mid, end, index);
+  return index;
+}
+
+float LightBVH::importance(const Node& n, const Vec& point) {
+  Vec center = (n.bounds.lower + n.bounds.upper) * 0.5f;
+  Vec toPoint = point - center;
+  float dist2 = toPoint.squaredNorm();
+  float radius2 = 0.25f * (n.bounds.upper - n.bounds.lower).squaredNorm();
+
+  // Don't let the estimate blow up for points near or inside the node.
+  float d2 = max(max(dist2, radius2), math::VERY_SMALL);
+  if (dist2 <= radius2) {
+    return n.power / d2;
+  }
+
+  // Find the smallest angle between the cone of normals and the direction
+  // from any point in the node's bounding sphere to the point. The emitters
+  // only light the side their normals face, so past 90 degrees it's dark.
+  float cosThetaW = n.cone.axis.dot(toPoint) / sqrtf(dist2);
+  float thetaW = acosf(math::clamp(cosThetaW, -1.0f, 1.0f));
+  float thetaB = asinf(sqrtf(radius2 / dist2));
+  float thetaPrime = max(0.0f, thetaW - n.cone.theta - thetaB);
+  if (thetaPrime >= math::PI_2) {
+    return 0.0f;
+  }
+
+  return n.power * cosf(thetaPrime) / d2;
+}
+
+bool LightBVH::sample(
+  Sampler& sampler,
+  const Vec& point,
+  size_t* indexOut,
+  float* pdfOut
+) const {
+  if (nodes.empty()) {
+    return false;
+  }
+
+  // One sample value drives the whole descent: after each choice, it is
+  // rescaled to [0, 1) within the branch taken, so that the stratification
+  // of the sample carries over to the choice of leaf.
+  float u = sampler.next1D();
+  float pdf = 1.0f;
+  size_t node = 0;
+  while (nodes[node].secondChild >= 0) {
+    size_t first = node + 1;
+    size_t second = size_t(nodes[node].secondChild);
+    float firstImportance = importance(nodes[first], point);
+    float secondImportance = importance(nodes[second], point);
+
+    float total = firstImportance + secondImportance;
+    if (total <= 0.0f) {
+      return false;
+    }
+
+    float probFirst = firstImportance / total;
+    if (u < probFirst) {
+      node = first;
+      pdf *= probFirst;
+      u = min(u / probFirst, math::ONE_MINUS_EPSILON);
+    } else {
+      node = second;
+      pdf *= 1.0f - probFirst;
+      u = min((u - probFirst) / (1.0f - probFirst), math::ONE_MINUS_EPSILON);
+    }
+  }
+
+  *indexOut = nodes[node].emitter;
+  *pdfOut = pdf;
+  return true;
+}
+
+float LightBVH::pdf(const Vec& point, const Geom* emitter) const {
+  auto it = leaves.find(emitter);
+  if (it == leaves.end()) {
+    return 0.0f;
+  }
+
+  // Walk up to the root, multiplying the probability of taking each branch
+  // on the way down.
+  float pdf = 1.0f;
+  size_t node = it->second;
+  while (nodes[node].parent >= 0) {
+    size_t parent = size_t(nodes[node].parent);
+    size_t first = parent + 1;
+    size_t second = size_t(nodes[parent].secondChild);
+    float firstImportance = importance(nodes[first], point);
+    float secondImportance = importance(nodes[second], point);
+
+    float total = firstImportance + secondImportance;
+    if (total <= 0.0f) {
+      return 0.0f;
+    }
+
+    pdf *= (node == first ? firstImportance : secondImportance) / total;
+    node = parent;
+  }
+
+  return pdf;
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include "core.h"
+#include "sampler.h"
+#include <unordered_map>
+#include <vector>
+
+class Geom;
+
+/**
+ * A bounding volume hierarchy over the emitters in a scene, used to pick a
+ * light for direct illumination. Each node bounds the positions, normals,
+ * and total power of the emitters below it, so that a light can be picked by
+ * a stochastic descent that favors nodes that are bright, close, and facing
+ * the point being illuminated. Picking a light takes logarithmic time in the
+ * number of emitters.
+ *
+ * See Estevez and Kulla, "Importance Sampling of Many Lights with Adaptive
+ * Tree Splitting" (2018).
+ */
+class LightBVH {
+  struct Node {
+    BBox bounds; /**< The bounds of the emitters below the node. */
+    NormalCone cone; /**< The normals of the emitters below the node. */
+    float power; /**< The total power of the emitters below the node. */
+    int parent; /**< The parent of the node, or -1 for the root. */
+    int secondChild; /**< The second child if interior, or -1 if a leaf. */
+    size_t emitter; /**< The index of the emitter, if this node is a leaf. */
+  };
+
+  struct BuildItem {
+    size_t emitter; /**< The index of the emitter. */
+    BBox bounds; /**< The bounds of the emitter. */
+    Vec centroid; /**< The center of the emitter's bounds. */
+    NormalCone cone; /**< The normals of the emitter. */
+    float power; /**< The power of the emitter. */
+  };
+
+  /**
+   * The nodes of the tree in depth-first order; the root comes first, and the
+   * first child of an interior node comes right after it.
+   */
+  std::vector<Node> nodes;
+
+  /** Maps each emitter in the tree to its leaf node. */
+  std::unordered_map<const Geom*, size_t> leaves;
+
+  /**
+   * Recursively builds the nodes for items in [start, end), splitting them
+   * at the median centroid along the longest axis.
+   *
+   * @param parent the parent of the new node, or -1 for the root
+   * @returns      the index of the node created for the items
+   */
+  int build(
+    std::vector<BuildItem>& items,
+    size_t start,
+    size_t end,
+    int parent
+  );
+
+  /**
+   * Estimates how much light the emitters below a node could contribute to
+   * the given point. This is conservative: zero means that none of the
+   * emitters face the point.
+   */
+  static float importance(const Node& n, const Vec& point);
+
+public:
+  /** Constructs an empty tree. */
+  LightBVH();
+
+  /**
+   * Constructs a tree over the given emitters. Emitters with no power are
+   * left out, since they can never contribute light.
+   *
+   * @param emitters the refined emitters in the scene
+   */
+  LightBVH(const std::vector<const Geom*>& emitters);
+
+  /**
+   * Picks an emitter to illuminate the given point, with probability
+   * proportional to the importance estimate at each level of the tree.
+   *
+   * @param sampler       the per-thread sampler in use
+   * @param point         the point to be illuminated
+   * @param indexOut [out] the index of the picked emitter
+   * @param pdfOut   [out] the probability of picking the emitter
+   * @returns             false if no emitter could illuminate the point (in
+   *                      which case the outputs are unmodified), otherwise
+   *                      true
+   */
+  bool sample(
+    Sampler& sampler,
+    const Vec& point,
+    size_t* indexOut,
+    float* pdfOut
+  ) const;
+
+  /**
+   * Returns the probability that LightBVH::sample would pick the given
+   * emitter to illuminate the given point.
+   *
+   * @param point   the point to be illuminated
+   * @param emitter the emitter, which may or may not be in the tree
+   */
+  float pdf(const Vec& point, const Geom* emitter) const;
+};
@@ -19,7 +19,43 @@ int main(int argc, char* argv[]) {
       ("output", value<std::string>()->default_value("output.exr"),
         "EXR output path")
       ("iterations", value<int>()->default_value(-1),
-        "path-tracing iterations, if < 0 then will run forever");
+        "path-tracing iterations, if < 0 then will run forever")
+      ("integrator", value<std::string>()->default_value("path"),
+        "path-tracing algorithm, either path, path-mis, or wavefront")
+      ("sampler", value<std::string>()->default_value("sobol"),
+        "sample generator, either independent, stratified, or sobol")
+      ("adaptive-threshold", value<float>()->default_value(0.0f),
+        "relative error at which pixels stop being sampled, if <= 0 then "
+        "adaptive sampling is disabled")
+      ("time-limit", value<float>()->default_value(0.0f),
+        "seconds by which the final image must be written, if <= 0 then "
+        "there is no time limit")
+      ("target-noise", value<float>()->default_value(0.0f),
+        "mean relative pixel error at which to stop, if <= 0 then rendering "
+        "does not stop based on noise")
+      ("progressive", bool_switch()->default_value(false),
+        "write 1/8, 1/4, and 1/2 resolution previews before full resolution")
+      ("path-guiding", bool_switch()->default_value(false),
+        "learn where light comes from and guide indirect bounces towards it")
+      ("deterministic", bool_switch()->default_value(false),
+        "seed the samples from --seed, so the image does not depend on the "
+        "run, thread count, or tiling")
+      ("seed", value<unsigned>()->default_value(0),
+        "seed of the samples when rendering deterministically")
+      ("denoise", bool_switch()->default_value(false),
+        "also write a denoised image, named like the output plus .denoised")
+      ("aovs", bool_switch()->default_value(false),
+        "write first-hit albedo, normal, position, and depth channels")
+      ("filter-importance-sampling", bool_switch()->default_value(false),
+        "draw samples in proportion to the pixel filter instead of splatting")
+      ("write-interval", value<float>()->default_value(0.0f),
+        "least time between writes of the output, in seconds")
+      ("geometric-writes", bool_switch()->default_value(false),
+        "only write the output after iterations 1, 2, 4, 8, ... and the last")
+      ("compression", value<std::string>()->default_value("none"),
+        "EXR compression, either none, zips, zip, or piz")
+      ("full-float", bool_switch()->default_value(false),
+        "write all channels as 32-bit floats instead of some as half-floats");
 
     positional_options_description pd;
     pd.add("input", 1).add("output", 1).add("iterations", 1);
@@ -43,9 +79,33 @@ int main(int argc, char* argv[]) {
     std::string output = vars["output"].as<std::string>();
     int iterations = vars["iterations"].as<int>();
 
+    RenderOptions opts;
+    opts.integrator =
+      RenderOptions::parseIntegrator(vars["integrator"].as<std::string>());
+    opts.sampler =
+      RenderOptions::parseSampler(vars["sampler"].as<std::string>());
+    opts.adaptiveThreshold = vars["adaptive-threshold"].as<float>();
+    opts.timeLimit = vars["time-limit"].as<float>();
+    opts.targetNoise = vars["target-noise"].as<float>();
+    opts.progressive = vars["progressive"].as<bool>();
+    opts.pathGuiding = vars["path-guiding"].as<bool>();
+    opts.deterministic = vars["deterministic"].as<bool>();
+    opts.seed = vars["seed"].as<unsigned>();
+    opts.denoise = vars["denoise"].as<bool>();
+    opts.featureOutput = vars["aovs"].as<bool>();
+    opts.filterImportanceSampling =
+      vars["filter-importance-sampling"].as<bool>();
+    opts.writeInterval = vars["write-interval"].as<float>();
+    opts.geometricWrites = vars["geometric-writes"].as<bool>();
+    opts.compression =
+      RenderOptions::parseCompression(vars["compression"].as<std::string>());
+    opts.fullFloatOutput = vars["full-float"].as<bool>();
+
     Embree::init();
     Scene scene(input);
-    scene.defaultCamera()->renderMultiple(output, iterations);
+    Camera* camera = scene.defaultCamera();
+    camera->setOptions(opts);
+    camera->renderMultiple(output, iterations);
     Embree::exit();
   } catch (std::exception& e) {
     debug::printNestedException(e);
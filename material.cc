@@ -3,15 +3,18 @@
 Material::~Material() {}
 
 void Material::scatter(
-  Randomness& rng,
+  Sampler& sampler,
   const Intersection& isect,
   Ray* rayOut,
-  Vec* betaInOut
+  Vec* betaInOut,
+  float* pdfOut
 ) const {
   Vec outgoingWorld;
   Vec bsdf;
   float pdf;
-  sampleWorld(isect, rng, -isect.incomingRay.direction, &outgoingWorld, &bsdf, &pdf);
+  sampleWorld(
+    isect, sampler, -isect.incomingRay.direction, &outgoingWorld, &bsdf, &pdf
+  );
 
   Vec scale;
   if (pdf > 0.0f) {
@@ -25,6 +28,9 @@ void Material::scatter(
     outgoingWorld
   );
   *betaInOut = betaInOut->cwiseProduct(scale);
+  if (pdfOut) {
+    *pdfOut = pdf;
+  }
 }
 
 float Material::evalPDFLocal(const Vec& incoming, const Vec& outgoing) const {
@@ -75,13 +81,15 @@ void Material::evalWorld(
 }
 
 void Material::sampleLocal(
-  Randomness& rng,
+  Sampler& sampler,
   const Vec& incoming,
   Vec* outgoingOut,
   Vec* bsdfOut,
   float* pdfOut
 ) const {
-  Vec outgoing = math::cosineSampleHemisphere(rng, incoming.z() < 0.0f);
+  Vec outgoing = math::cosineSampleHemisphere(
+    sampler.next2D(), incoming.z() < 0.0f
+  );
 
   *outgoingOut = outgoing;
   *bsdfOut = evalBSDFLocal(incoming, outgoing);
@@ -90,7 +98,7 @@ void Material::sampleLocal(
 
 void Material::sampleWorld(
   const Intersection& isect,
-  Randomness& rng,
+  Sampler& sampler,
   const Vec& incoming,
   Vec* outgoingOut,
   Vec* bsdfOut,
@@ -112,7 +120,7 @@ void Material::sampleWorld(
   Vec outgoingLocal;
   Vec tempBsdf;
   float tempPdf;
-  sampleLocal(rng, incomingLocal, &outgoingLocal, &tempBsdf, &tempPdf);
+  sampleLocal(sampler, incomingLocal, &outgoingLocal, &tempBsdf, &tempPdf);
 
   // Rendering expects outgoing ray to be in world-space.
   Vec outgoingWorld = math::localToWorld(
@@ -1,5 +1,6 @@
 #pragma once
 #include "core.h"
+#include "sampler.h"
 #include "node.h"
 
 /**
@@ -37,7 +38,7 @@ public:
    * Calculates the transmittance and scatters another ray from an
    * intersection.
    *
-   * @param rng                the per-thread RNG in use
+   * @param sampler            the per-thread sampler in use
    * @param isect              the intersection information for the incoming ray
    * @param rayOut    [out]    a ray to cast as a consequence;
    *                           a zero-length ray will terminate the path
@@ -45,12 +46,14 @@ public:
    *                           adjusted based on the transmittance at the
    *                           intersection, taking into account BSDF, PDF,
    *                           and the geometry term
+   * @param pdfOut    [out]    if not null, the PDF of the sampled direction
    */
   void scatter(
-    Randomness& rng,
+    Sampler& sampler,
     const Intersection& isect,
     Ray* rayOut,
-    Vec* betaInOut
+    Vec* betaInOut,
+    float* pdfOut = nullptr
   ) const;
 
   /**
@@ -62,7 +65,7 @@ public:
    * If you override this function, you must also override
    * Material::evalPDFLocal.
    *
-   * @param rng               the per-thread RNG in use
+   * @param sampler           the per-thread sampler in use
    * @param incoming    [out] the sampled direction; the pointer must not be
    *                          null
    * @param outgoingOut [out] the outgoing vector that was sampled;
@@ -73,7 +76,7 @@ public:
    *                          the pointer must not be null
    */
   virtual void sampleLocal(
-    Randomness& rng,
+    Sampler& sampler,
     const Vec& incoming,
     Vec* outgoingOut,
     Vec* bsdfOut,
@@ -86,7 +89,7 @@ public:
    */
   void sampleWorld(
     const Intersection& isect,
-    Randomness& rng,
+    Sampler& sampler,
     const Vec& incoming,
     Vec* outgoingOut,
     Vec* bsdfOut,
@@ -126,4 +129,10 @@ public:
    * this material. Otherwise, only path tracing will be used.
    */
   virtual bool shouldDirectIlluminate() const = 0;
+
+  /**
+   * Returns the overall color of the material, independent of lighting and
+   * direction. This is the albedo feature that guides denoising.
+   */
+  virtual Vec reflectance() const = 0;
 };
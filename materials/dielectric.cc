@@ -34,7 +34,7 @@ float materials::Dielectric::evalPDFLocal(
 }
 
 void materials::Dielectric::sampleLocal(
-  Randomness& rng,
+  Sampler& sampler,
   const Vec& incoming,
   Vec* outgoingOut,
   Vec* bsdfOut,
@@ -105,7 +105,7 @@ void materials::Dielectric::sampleLocal(
   float probRefr = 1.0f - probRefl;
 
   // Probabilistically choose to refract or reflect.
-  if (rng.nextUnitFloat() < probRefl) {
+  if (sampler.next1D() < probRefl) {
     // Higher reflectance = higher probability of reflecting.
     *outgoingOut = reflectVector;
     *bsdfOut = color * refl / math::absCosTheta(reflectVector);
@@ -120,3 +120,7 @@ void materials::Dielectric::sampleLocal(
 bool materials::Dielectric::shouldDirectIlluminate() const {
   return false;
 }
+
+Vec materials::Dielectric::reflectance() const {
+  return color;
+}
@@ -50,7 +50,7 @@ namespace materials {
     Dielectric(const Node& n);
 
     virtual void sampleLocal(
-      Randomness& rng,
+      Sampler& sampler,
       const Vec& incoming,
       Vec* outgoingOut,
       Vec* bsdfOut,
@@ -58,6 +58,8 @@ namespace materials {
     ) const override;
 
     virtual bool shouldDirectIlluminate() const override;
+
+    virtual Vec reflectance() const override;
   };
 
 }
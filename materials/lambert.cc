@@ -18,3 +18,7 @@ Vec materials::Lambert::evalBSDFLocal(
 bool materials::Lambert::shouldDirectIlluminate() const {
   return true;
 }
+
+Vec materials::Lambert::reflectance() const {
+  return albedo;
+}
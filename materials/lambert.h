@@ -23,6 +23,8 @@ namespace materials {
     Lambert(const Node& n);
 
     virtual bool shouldDirectIlluminate() const override;
+
+    virtual Vec reflectance() const override;
   };
 
 }
@@ -58,7 +58,7 @@ float materials::Phong::evalPDFLocal(
 }
 
 void materials::Phong::sampleLocal(
-  Randomness& rng,
+  Sampler& sampler,
   const Vec& incoming,
   Vec* outgoingOut,
   Vec* bsdfOut,
@@ -90,9 +90,10 @@ void materials::Phong::sampleLocal(
    *
    * @endcode
    */
-  float cosTheta = std::pow(rng.nextUnitFloat(), invExponent);
+  Vec2 u = sampler.next2D();
+  float cosTheta = std::pow(u[0], invExponent);
   float sinTheta = sqrtf(1.0f - cosTheta * cosTheta);
-  float phi = math::TWO_PI * rng.nextUnitFloat();
+  float phi = math::TWO_PI * u[1];
   Vec local(cosf(phi) * sinTheta, sinf(phi) * sinTheta, cosTheta);
 
   // Here, "local" being the space of the perfect reflection vector and
@@ -110,3 +111,7 @@ void materials::Phong::sampleLocal(
 bool materials::Phong::shouldDirectIlluminate() const {
   return true;
 }
+
+Vec materials::Phong::reflectance() const {
+  return color;
+}
@@ -55,7 +55,7 @@ namespace materials {
     Phong(const Node& n);
 
     virtual void sampleLocal(
-      Randomness& rng,
+      Sampler& sampler,
       const Vec& incoming,
       Vec* outgoingOut,
       Vec* bsdfOut,
@@ -63,6 +63,8 @@ namespace materials {
     ) const override;
 
     virtual bool shouldDirectIlluminate() const override;
+
+    virtual Vec reflectance() const override;
   };
 
 }
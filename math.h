@@ -33,6 +33,9 @@ namespace math {
   /** A very big non-infinite value. */
   static constexpr float VERY_BIG = std::numeric_limits<float>::max();
 
+  /** The largest float below 1, for clamping values to [0, 1). */
+  static constexpr float ONE_MINUS_EPSILON = 0.99999994f;
+
   /** Pi as a single-precision float. */
   static constexpr float PI = float(M_PI);
 
@@ -358,13 +361,13 @@ namespace math {
    *
    * Taken from Pharr & Humphreys' p. 667.
    *
-   * @param rng      the per-thread RNG in use
+   * @param u        a uniformly-distributed point in [0, 1)^2
    * @param dx [out] the x-coordinate of the sample
    * @param dy [out] the y-coordinate of the sample
    */
-  inline void areaSampleDisk(Randomness& rng, float* dx, float* dy) {
-    float sx = rng.nextFloat(-1.0f, 1.0f);
-    float sy = rng.nextFloat(-1.0f, 1.0f);
+  inline void areaSampleDisk(const Vec2& u, float* dx, float* dy) {
+    float sx = 2.0f * u[0] - 1.0f;
+    float sy = 2.0f * u[1] - 1.0f;
 
     // Handle degeneracy at the origin.
     if (sx == 0.0f && sy == 0.0f) {
@@ -422,16 +425,16 @@ namespace math {
    *
    * Taken from Pharr & Humphreys p. 669.
    *
-   * @param rng     the per-thread RNG in use
+   * @param u       a uniformly-distributed point in [0, 1)^2
    * @param flipped whether to sample from the hemisphere on the negative
    *                Z-axis instead; false will sample from the positive
    *                hemisphere and true will sample from the negative hemisphere
    * @returns       a cosine-weighted random vector in the hemisphere;
    *                the pointer must not be null
    */
-  inline Vec cosineSampleHemisphere(Randomness& rng, bool flipped) {
+  inline Vec cosineSampleHemisphere(const Vec2& u, bool flipped) {
     Vec ret;
-    areaSampleDisk(rng, &ret[0], &ret[1]);
+    areaSampleDisk(u, &ret[0], &ret[1]);
     ret[2] = sqrtf(max(0.0f, 1.0f - ret[0] * ret[0] - ret[1] * ret[1]));
     if (flipped) {
       ret[2] *= -1.0f;
@@ -451,17 +454,17 @@ namespace math {
    * Uniformly samples from a unit sphere, with respect to the sphere's
    * surface area.
    *
-   * @param rng the per-thread RNG in use
-   * @returns   the uniformly-distributed random vector in the sphere
+   * @param u a uniformly-distributed point in [0, 1)^2
+   * @returns  the uniformly-distributed random vector in the sphere
    */
-  inline Vec uniformSampleSphere(Randomness& rng) {
-    // See MathWorld <http://mathworld.wolfram.com/SpherePointPicking.html>.
-    float x = rng.nextNormalFloat();
-    float y = rng.nextNormalFloat();
-    float z = rng.nextNormalFloat();
-    float a = 1.0f / sqrtf(x * x + y * y + z * z);
+  inline Vec uniformSampleSphere(const Vec2& u) {
+    // Archimedes: z is uniform on [-1, 1], and so is the area above it. See
+    // MathWorld <http://mathworld.wolfram.com/SpherePointPicking.html>.
+    float z = 1.0f - 2.0f * u[0];
+    float r = sqrtf(max(0.0f, 1.0f - z * z));
+    float t = float(PI * 2.0) * u[1];
 
-    return Vec(a * x, a * y, a * z);
+    return Vec(r * cosf(t), r * sinf(t), z);
   }
 
   /**
@@ -516,16 +519,16 @@ namespace math {
    * ListPointPlot3D[Map[R, Range[1000]], BoxRatios -> Automatic]
    * \endcode
    *
-   * @param rng       the per-thread RNG in use
+   * @param u         a uniformly-distributed point in [0, 1)^2
    * @param halfAngle the half-angle of the cone's opening; must be between 0
    *                  and Pi/2 and in radians
    * @returns         a uniformally-random vector within halfAngle radians of
    *                  the positive z-axis
    */
-  inline Vec uniformSampleCone(Randomness& rng, float halfAngle) {
+  inline Vec uniformSampleCone(const Vec2& u, float halfAngle) {
     float h = cosf(halfAngle);
-    float z = rng.nextFloat(h, 1.0f);
-    float t = rng.nextFloat(float(PI * 2.0));
+    float z = h + (1.0f - h) * u[0];
+    float t = float(PI * 2.0) * u[1];
     float r = sqrtf(1.0f - (z * z));
     float x = r * cosf(t);
     float y = r * sinf(t);
@@ -0,0 +1,49 @@
+#include "options.h"
+#include <exception>
+#include <boost/format.hpp>
+
+using boost::format;
+
+IntegratorType RenderOptions::parseIntegrator(const std::string& name) {
+  if (name == "path") {
+    return IntegratorType::PATH;
+  } else if (name == "path-mis") {
+    return IntegratorType::PATH_MIS;
+  } else if (name == "wavefront") {
+    return IntegratorType::WAVEFRONT;
+  }
+
+  throw std::runtime_error(
+    str(format("'%1%' is not a recognized integrator") % name)
+  );
+}
+
+SamplerType RenderOptions::parseSampler(const std::string& name) {
+  if (name == "independent") {
+    return SamplerType::INDEPENDENT;
+  } else if (name == "stratified") {
+    return SamplerType::STRATIFIED;
+  } else if (name == "sobol") {
+    return SamplerType::SOBOL;
+  }
+
+  throw std::runtime_error(
+    str(format("'%1%' is not a recognized sampler") % name)
+  );
+}
+
+ExrCompression RenderOptions::parseCompression(const std::string& name) {
+  if (name == "none") {
+    return ExrCompression::NONE;
+  } else if (name == "zips") {
+    return ExrCompression::ZIPS;
+  } else if (name == "zip") {
+    return ExrCompression::ZIP;
+  } else if (name == "piz") {
+    return ExrCompression::PIZ;
+  }
+
+  throw std::runtime_error(
+    str(format("'%1%' is not a recognized compression") % name)
+  );
+}
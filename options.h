@@ -0,0 +1,176 @@
+#pragma once
+#include <string>
+
+/**
+ * The algorithms that can be used to trace paths through the scene.
+ */
+enum class IntegratorType {
+  /** Follows one path to the end before starting the next (Camera::trace). */
+  PATH,
+  /**
+   * Like PATH, but the BSDF sample that continues the path also serves as the
+   * BSDF-sampling strategy of the direct lighting at each vertex, instead of
+   * a separate BSDF sample and ray.
+   */
+  PATH_MIS,
+  /** Advances all paths of a tile together, one stage at a time. */
+  WAVEFRONT
+};
+
+/**
+ * The ways of generating the sample values that drive each path (see
+ * Sampler).
+ */
+enum class SamplerType {
+  /** Independent uniform random values. */
+  INDEPENDENT,
+  /** Jittered strata of each iteration's samples, permuted per dimension. */
+  STRATIFIED,
+  /**
+   * Owen-scrambled Sobol points, shuffled per dimension; these are also
+   * stratified like progressive multi-jittered (0,2) points.
+   */
+  SOBOL
+};
+
+/**
+ * The ways of compressing the pixels of the output OpenEXR files. All of them
+ * are lossless.
+ */
+enum class ExrCompression {
+  /** No compression; the fastest to write, but the largest files. */
+  NONE,
+  /** Deflate, one scanline at a time. */
+  ZIPS,
+  /** Deflate, in blocks of 16 scanlines. */
+  ZIP,
+  /** Wavelet and Huffman coding, in blocks of 32 scanlines; best for noise. */
+  PIZ
+};
+
+/**
+ * Settings that control how a camera renders, independent of the scene.
+ * These are normally filled in from the command line.
+ */
+struct RenderOptions {
+  IntegratorType integrator; /**< The path-tracing algorithm to use. */
+  SamplerType sampler; /**< The sample generator to use. */
+
+  /**
+   * The relative error at which a pixel is considered converged and stops
+   * being sampled. If <= 0, then every pixel is sampled in every iteration.
+   */
+  float adaptiveThreshold;
+
+  /**
+   * The wall-clock time, in seconds, by which rendering must have finished
+   * and written its final image. If <= 0, then there is no time limit.
+   */
+  float timeLimit;
+
+  /**
+   * The mean relative pixel error at which rendering stops. If <= 0, then
+   * rendering does not stop based on noise.
+   */
+  float targetNoise;
+
+  /**
+   * Whether to render and write low-resolution previews before the first
+   * full-resolution iteration.
+   */
+  bool progressive;
+
+  /**
+   * Whether to guide scattering on non-specular surfaces by the radiance
+   * distribution learned in earlier iterations.
+   */
+  bool pathGuiding;
+
+  /**
+   * Whether to seed the samples from seed instead of from true randomness.
+   * The image then only depends on the scene, the options, and the seed,
+   * not on the number of threads or the tiling, so a frame can be split
+   * across processes. This does not cover what depends on timing or thread
+   * scheduling: the samples per iteration chosen for a time limit or noise
+   * target, and the guiding tree learned by path guiding.
+   */
+  bool deterministic;
+
+  /** The seed of the samples, if rendering deterministically. */
+  unsigned seed;
+
+  /**
+   * Whether to also write a denoised copy of the image after each iteration,
+   * next to the raw one (see Denoiser).
+   */
+  bool denoise;
+
+  /**
+   * Whether to write the first-hit albedo, normal, position, and depth as
+   * extra channels of the output (see Image::setFeatureOutput).
+   */
+  bool featureOutput;
+
+  /**
+   * Whether to draw sample offsets in proportion to the pixel filter instead
+   * of splatting each sample over its neighbors (see
+   * Image::setFilterImportanceSampling).
+   */
+  bool filterImportanceSampling;
+
+  /**
+   * The least time between two writes of the output, in seconds. Iterations
+   * that end sooner after the last write are not written (the last one
+   * always is).
+   */
+  float writeInterval;
+
+  /**
+   * Whether to only write the output after iterations 1, 2, 4, 8, and so on
+   * (and the last one), which is often enough for a render that converges
+   * at the usual rate.
+   */
+  bool geometricWrites;
+
+  /** How to compress the output files. */
+  ExrCompression compression;
+
+  /**
+   * Whether to store every channel of the output files as 32-bit floats,
+   * including those (such as the colors) that are normally half-floats.
+   */
+  bool fullFloatOutput;
+
+  /** Constructs the default rendering options. */
+  RenderOptions()
+    : integrator(IntegratorType::PATH), sampler(SamplerType::SOBOL),
+      adaptiveThreshold(0), timeLimit(0), targetNoise(0), progressive(false),
+      pathGuiding(false), deterministic(false), seed(0), denoise(false),
+      featureOutput(false), filterImportanceSampling(false),
+      writeInterval(0), geometricWrites(false),
+      compression(ExrCompression::NONE), fullFloatOutput(false) {}
+
+  /**
+   * Converts an integrator name ("path", "path-mis", or "wavefront") to its
+   * type.
+   *
+   * @throws std::runtime_error if the name is not recognized
+   */
+  static IntegratorType parseIntegrator(const std::string& name);
+
+  /**
+   * Converts a sampler name ("independent", "stratified", or "sobol") to its
+   * type.
+   *
+   * @throws std::runtime_error if the name is not recognized
+   */
+  static SamplerType parseSampler(const std::string& name);
+
+  /**
+   * Converts a compression name ("none", "zips", "zip", or "piz") to its
+   * type.
+   *
+   * @throws std::runtime_error if the name is not recognized
+   */
+  static ExrCompression parseCompression(const std::string& name);
+};
@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+ * Parallel loops use TBB (Linux/Mac) or PPL (Windows). Both provide a
+ * compatible parallel_for and a work-stealing task scheduler, so code can be
+ * written once against the `parallel` namespace alias.
+ */
+#ifdef _WIN32
+  #include <ppl.h>
+  #include <concurrent_vector.h>
+  namespace parallel = Concurrency;
+#else
+  #include <tbb/tbb.h>
+  namespace parallel = tbb;
+#endif
@@ -1,23 +1,67 @@
 #pragma once
+#include <cstdint>
 #include <random>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 /**
- * A unified RNG capable of generating random floating-point and integer
- * values. Not thread-safe; use a separate randomness object for each thread.
+ * The PCG32 random number generator (PCG-XSH-RR with a 64-bit LCG state),
+ * from O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically
+ * Good Algorithms for Random Number Generation" (2014). Its whole state is
+ * 16 bytes, so it is cheap to seed, and each number takes a multiply-add and
+ * a few bit operations. Meets the requirements of a standard uniform random
+ * bit generator, so it can drive the std distributions.
  */
-class Randomness {
-  /**
-   * Uniform [0, 1) floating-point distribution.
-   */
-  std::uniform_real_distribution<float> unitDist;
+class PCG32 {
+  uint64_t state; /**< The LCG state. */
+  uint64_t inc; /**< The LCG increment, which selects the stream; odd. */
+
+public:
+  typedef uint32_t result_type;
+
   /**
-   * Uniform distribution over all possible int's.
+   * Constructs a generator.
+   *
+   * @param seed   the starting state
+   * @param stream selects one of 2^63 independent sequences
    */
-  std::uniform_int_distribution<int> intDist;
+  explicit PCG32(uint64_t seed, uint64_t stream = 0xda3e39cb94b95bdbull)
+    : state(0), inc((stream << 1) | 1u)
+  {
+    (*this)();
+    state += seed;
+    (*this)();
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return 0xffffffffu; }
+
   /**
-   * Uniform distribution over all possible unsigned's.
+   * Returns the next 32 random bits.
    */
-  std::uniform_int_distribution<unsigned> unsignedDist;
+  inline result_type operator()() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ull + inc;
+    uint32_t xorShifted = uint32_t(((old >> 18) ^ old) >> 27);
+    uint32_t rot = uint32_t(old >> 59);
+    return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+  }
+};
+
+/**
+ * A unified RNG capable of generating random floating-point and integer
+ * values. Not thread-safe; use a separate randomness object for each thread.
+ *
+ * Uniform floats are made directly from the top 24 bits of the engine's
+ * output, which gives every representable multiple of 2^-24 in [0, 1) with
+ * equal probability, without going through the std distributions.
+ *
+ * @tparam Engine a standard uniform random bit generator with 32-bit output
+ */
+template<typename Engine>
+class BasicRandomness {
   /**
    * Standard Gaussian (normal) distribution.
    */
@@ -25,7 +69,7 @@ class Randomness {
   /**
    * The engine used internally for the RNG.
    */
-  std::mt19937 rng;
+  Engine rng;
 
   /**
    * Returns a seed based on true device randomness.
@@ -37,46 +81,51 @@ class Randomness {
     return seedDist(randDevice);
   }
 
+  /**
+   * Returns the next 32 random bits from the engine.
+   */
+  inline uint32_t nextBits() { return uint32_t(rng()); }
+
 public:
   /**
    * Constructs a randomness object from a truly random seed.
    */
-  Randomness()
-    : unitDist(), intDist(), unsignedDist(), normalDist(), rng(createSeed()) {}
+  BasicRandomness() : normalDist(), rng(createSeed()) {}
 
   /**
    * Constructs a randomness object from the given seed.
    */
-  Randomness(unsigned seed)
-    : unitDist(), intDist(), unsignedDist(), rng(seed) {}
+  BasicRandomness(unsigned seed) : normalDist(), rng(seed) {}
 
   /**
    * Samples a random int.
    */
-  inline int nextInt() { return intDist(rng); }
+  inline int nextInt() { return int(nextBits()); }
 
   /**
    * Samples a random unsigned.
    */
-  inline unsigned nextUnsigned() { return unsignedDist(rng); }
+  inline unsigned nextUnsigned() { return nextBits(); }
 
   /**
    * Samples a random float between 0 (inclusive) and 1 (exclusive).
    */
-  inline float nextUnitFloat() { return unitDist(rng); }
+  inline float nextUnitFloat() {
+    return float(nextBits() >> 8) * (1.0f / 16777216.0f);
+  }
 
   /**
    * Samples a random float between 0 (inclusive) and max (exclusive).
    */
   inline float nextFloat(float max) {
-    return max * unitDist(rng);
+    return max * nextUnitFloat();
   }
 
   /**
    * Samples a random float between min (inclusive) and max (exclusive).
    */
   inline float nextFloat(float min, float max) {
-    return min + (max - min) * unitDist(rng);
+    return min + (max - min) * nextUnitFloat();
   }
 
   /**
@@ -84,3 +133,92 @@ public:
    */
   inline float nextNormalFloat() { return normalDist(rng); }
 };
+
+/**
+ * Randomness backed by the Mersenne Twister, the engine used before PCG32.
+ * It is much slower to seed and has a 2.5 KB state, but is kept for
+ * comparing the quality of the two.
+ */
+typedef BasicRandomness<std::mt19937> MTRandomness;
+
+#ifdef MT19937_RANDOMNESS
+typedef MTRandomness Randomness;
+#else
+typedef BasicRandomness<PCG32> Randomness;
+#endif
+
+/**
+ * A counter-based generator of uniform floats, eight at a time: the i-th
+ * value of a stream is a hash of the stream's key and i. There is no state
+ * to set up besides the key and the counter, so a new stream costs nothing,
+ * even if only a few values are drawn from it. The hash ("lowbias32",
+ * applied twice) only needs 32-bit multiplies, shifts, and xors, so all
+ * eight values are made in a handful of AVX2 instructions (or, without AVX2,
+ * in a loop that the compiler vectorizes). Not thread-safe.
+ */
+class RandomnessX8 {
+public:
+  /** The number of floats generated at a time. */
+  static constexpr int WIDTH = 8;
+
+private:
+  uint32_t key; /**< Selects the stream. */
+  uint32_t counter; /**< The index of the next value in the stream. */
+
+  /** Mixes the bits of a 32-bit value (the "lowbias32" hash). */
+  static inline uint32_t mixBits(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+  }
+
+#ifdef __AVX2__
+  /** Mixes the bits of eight 32-bit values (see mixBits). */
+  static inline __m256i mixBits(__m256i h) {
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x7feb352d));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32(int(0x846ca68bu)));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    return h;
+  }
+#endif
+
+public:
+  /**
+   * Starts the stream selected by the seed.
+   */
+  RandomnessX8(unsigned seed) : key(seed), counter(0) {}
+
+  /**
+   * Samples WIDTH random floats between 0 (inclusive) and 1 (exclusive).
+   *
+   * @param out [out] an array of at least WIDTH floats
+   */
+  inline void nextUnitFloats(float* out) {
+#ifdef __AVX2__
+    __m256i index = _mm256_add_epi32(
+      _mm256_set1_epi32(int(counter)),
+      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)
+    );
+    __m256i h = mixBits(
+      _mm256_xor_si256(mixBits(index), _mm256_set1_epi32(int(key)))
+    );
+
+    __m256 floats = _mm256_mul_ps(
+      _mm256_cvtepi32_ps(_mm256_srli_epi32(h, 8)),
+      _mm256_set1_ps(1.0f / 16777216.0f)
+    );
+    _mm256_storeu_ps(out, floats);
+#else
+    for (int lane = 0; lane < WIDTH; ++lane) {
+      uint32_t h = mixBits(mixBits(counter + uint32_t(lane)) ^ key);
+      out[lane] = float(h >> 8) * (1.0f / 16777216.0f);
+    }
+#endif
+    counter += WIDTH;
+  }
+};
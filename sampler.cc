@@ -0,0 +1,234 @@
+#include "sampler.h"
+
+using std::max;
+using std::min;
+
+/** Mixes the bits of a 32-bit value (the "lowbias32" hash). */
+static inline unsigned mixBits(unsigned h) {
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+/** Reverses the order of the bits of a 32-bit value. */
+static inline unsigned reverseBits(unsigned x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+/**
+ * A hash that only lets each bit affect the bits above it, so that reversing
+ * the bits before and after it gives a nested uniform (Owen) scramble. See
+ * Burley (2020), building on Laine and Karras (2011).
+ */
+static inline unsigned laineKarrasPermutation(unsigned x, unsigned seed) {
+  x ^= x * 0x3d20adeau;
+  x += seed;
+  x *= (seed >> 16) | 1u;
+  x ^= x * 0x05526c56u;
+  x ^= x * 0x53a22864u;
+  return x;
+}
+
+/** Owen-scrambles the bits of a 32-bit fixed-point value in [0, 1). */
+static inline unsigned nestedUniformScramble(unsigned x, unsigned seed) {
+  return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+/** The second dimension of the Sobol sequence, as 32-bit fixed point. */
+static inline unsigned sobolSecondDimension(unsigned index) {
+  unsigned result = 0;
+  for (unsigned v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+    if (index & 1u) {
+      result ^= v;
+    }
+  }
+  return result;
+}
+
+/** Converts 32-bit fixed point to a float in [0, 1). */
+static inline float toUnitFloat(unsigned x) {
+  return float(x >> 8) * (1.0f / 16777216.0f);
+}
+
+Sampler::Sampler(unsigned s)
+  : rng(s), seed(s), firstSampleIndex(0), samplesPerPixel(1),
+    pixelX(0), pixelY(0), sampleIndex(0), dimension(0), dimensionEnd(0) {}
+
+std::unique_ptr<Sampler> Sampler::create(SamplerType type, unsigned s) {
+  switch (type) {
+    case SamplerType::INDEPENDENT:
+      return std::unique_ptr<Sampler>(new IndependentSampler(s));
+    case SamplerType::STRATIFIED:
+      return std::unique_ptr<Sampler>(new StratifiedSampler(s));
+    case SamplerType::SOBOL:
+    default:
+      return std::unique_ptr<Sampler>(new SobolSampler(s));
+  }
+}
+
+unsigned Sampler::hashDimension(int dim) const {
+  unsigned h = mixBits(unsigned(dim) + 0x9e3779b9u);
+  h = mixBits(h ^ unsigned(pixelY));
+  h = mixBits(h ^ unsigned(pixelX));
+  return mixBits(h ^ seed);
+}
+
+void Sampler::startIteration(unsigned first, int count) {
+  firstSampleIndex = first;
+  samplesPerPixel = count;
+}
+
+void Sampler::startStream(unsigned streamSeed) {
+  rng = Randomness(streamSeed);
+}
+
+void Sampler::startDimensions(int first, int count) {
+  dimension = first;
+  dimensionEnd = first + count;
+
+  // The index within the whole sequence stands for both the iteration and
+  // the sample within it.
+  unsigned h = hashDimension(first);
+  startStream(mixBits(h ^ (firstSampleIndex + unsigned(sampleIndex))));
+}
+
+void Sampler::startPixelSample(int x, int y, int index) {
+  pixelX = x;
+  pixelY = y;
+  sampleIndex = index;
+  startDimensions(0, CAMERA_DIMENSIONS);
+}
+
+void Sampler::startLighting(int depth) {
+  startDimensions(
+    CAMERA_DIMENSIONS + depth * (LIGHT_DIMENSIONS + SCATTER_DIMENSIONS),
+    LIGHT_DIMENSIONS
+  );
+}
+
+void Sampler::startScattering(int depth) {
+  startDimensions(
+    CAMERA_DIMENSIONS + depth * (LIGHT_DIMENSIONS + SCATTER_DIMENSIONS)
+      + LIGHT_DIMENSIONS,
+    SCATTER_DIMENSIONS
+  );
+}
+
+IndependentSampler::IndependentSampler(unsigned s)
+  : Sampler(s), wideRng(s), buffer(), bufferPos(RandomnessX8::WIDTH) {}
+
+void IndependentSampler::startStream(unsigned streamSeed) {
+  Sampler::startStream(streamSeed);
+  wideRng = RandomnessX8(streamSeed);
+  bufferPos = RandomnessX8::WIDTH;
+}
+
+float IndependentSampler::sample1D(int /* dim */) {
+  return nextBuffered();
+}
+
+Vec2 IndependentSampler::sample2D(int /* dim */) {
+  float u = nextBuffered();
+  return Vec2(u, nextBuffered());
+}
+
+StratifiedSampler::StratifiedSampler(unsigned s) : Sampler(s) {}
+
+unsigned StratifiedSampler::permute(unsigned i, unsigned count, unsigned key) {
+  unsigned w = count - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+
+  // Permute within the next power of two, and cycle-walk until the result
+  // lands back in [0, count).
+  do {
+    i ^= key;
+    i *= 0xe170893du;
+    i ^= key >> 16;
+    i ^= (i & w) >> 4;
+    i ^= key >> 8;
+    i *= 0x0929eb3fu;
+    i ^= key >> 23;
+    i ^= (i & w) >> 1;
+    i *= 1u | key >> 27;
+    i *= 0x6935fa69u;
+    i ^= (i & w) >> 11;
+    i *= 0x74dcb303u;
+    i ^= (i & w) >> 2;
+    i *= 0x9e501cc3u;
+    i ^= (i & w) >> 2;
+    i *= 0xc860a3dfu;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= count);
+
+  return (i + key) % count;
+}
+
+float StratifiedSampler::sample1D(int dim) {
+  // Each iteration gets its own permutation.
+  unsigned key = hashDimension(dim) ^ mixBits(firstSampleIndex);
+  unsigned count = unsigned(samplesPerPixel);
+  unsigned stratum = permute(unsigned(sampleIndex), count, key);
+  return min(
+    (float(stratum) + rng.nextUnitFloat()) / float(count),
+    math::ONE_MINUS_EPSILON
+  );
+}
+
+Vec2 StratifiedSampler::sample2D(int dim) {
+  // Use a grid that is as square as possible with at least one cell per
+  // sample; if there are more cells than samples, some are left empty.
+  int cellsX = max(1, int(sqrtf(float(samplesPerPixel))));
+  int cellsY = (samplesPerPixel + cellsX - 1) / cellsX;
+
+  unsigned key = hashDimension(dim) ^ mixBits(firstSampleIndex);
+  unsigned cell =
+    permute(unsigned(sampleIndex), unsigned(cellsX * cellsY), key);
+  float jitterX = rng.nextUnitFloat();
+  float jitterY = rng.nextUnitFloat();
+  return Vec2(
+    min((float(cell % unsigned(cellsX)) + jitterX) / float(cellsX),
+      math::ONE_MINUS_EPSILON),
+    min((float(cell / unsigned(cellsX)) + jitterY) / float(cellsY),
+      math::ONE_MINUS_EPSILON)
+  );
+}
+
+SobolSampler::SobolSampler(unsigned s) : Sampler(s) {}
+
+float SobolSampler::sample1D(int dim) {
+  unsigned h = hashDimension(dim);
+  unsigned index =
+    nestedUniformScramble(firstSampleIndex + unsigned(sampleIndex), h);
+  return toUnitFloat(
+    nestedUniformScramble(reverseBits(index), mixBits(h ^ 0xa511e9b3u))
+  );
+}
+
+Vec2 SobolSampler::sample2D(int dim) {
+  unsigned h = hashDimension(dim);
+  unsigned index =
+    nestedUniformScramble(firstSampleIndex + unsigned(sampleIndex), h);
+  return Vec2(
+    toUnitFloat(
+      nestedUniformScramble(reverseBits(index), mixBits(h ^ 0xa511e9b3u))
+    ),
+    toUnitFloat(
+      nestedUniformScramble(
+        sobolSecondDimension(index), mixBits(h ^ 0x63d83595u)
+      )
+    )
+  );
+}
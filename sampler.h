@@ -0,0 +1,216 @@
+#pragma once
+#include "core.h"
+#include "options.h"
+#include <memory>
+
+/**
+ * Generates the values in [0, 1) that drive the random decisions of a path:
+ * where in the pixel it starts, where on the lens, which light it samples
+ * and where, and how it scatters.
+ *
+ * The values of one path sample form a point in a high-dimensional space,
+ * one dimension (or pair of dimensions) per decision. Each decision always
+ * gets the same dimension, so the samples of a pixel can be spread evenly
+ * over every decision instead of clumping like independent random values.
+ * Dimensions are laid out as:
+ *   - CAMERA_DIMENSIONS for the camera ray;
+ *   - then, for each bounce, LIGHT_DIMENSIONS for direct lighting followed
+ *     by SCATTER_DIMENSIONS for scattering and Russian Roulette.
+ * A decision that runs past the dimensions reserved for it gets independent
+ * random values instead.
+ *
+ * Every value, random ones included, is a function of the seed, the pixel,
+ * the sample index, and the dimension only. The random values come from a
+ * stream that is reseeded from a hash of those at the start of each range
+ * of dimensions. So the samples do not depend on which thread or tile takes
+ * a pixel, or in what order.
+ *
+ * Not thread-safe; use a separate sampler for each thread.
+ */
+class Sampler {
+public:
+  /** The number of dimensions reserved for the camera ray. */
+  static constexpr int CAMERA_DIMENSIONS = 2;
+  /** The number of dimensions reserved for each bounce's direct lighting. */
+  static constexpr int LIGHT_DIMENSIONS = 4;
+  /** The number of dimensions reserved for each bounce's scattering. */
+  static constexpr int SCATTER_DIMENSIONS = 8;
+
+protected:
+  /**
+   * Supplies values past the reserved dimensions, as well as the jitter of
+   * the stratified sampler. Reseeded for each range of dimensions.
+   */
+  Randomness rng;
+
+  const unsigned seed; /**< Scrambles the sequences; fixed for a render. */
+  unsigned firstSampleIndex; /**< The index of the iteration's first sample. */
+  int samplesPerPixel; /**< The number of samples in the iteration. */
+  int pixelX; /**< The x-coordinate of the current pixel. */
+  int pixelY; /**< The y-coordinate of the current pixel. */
+  int sampleIndex; /**< The index of the current sample in the iteration. */
+  int dimension; /**< The next dimension to be used. */
+  int dimensionEnd; /**< The end of the dimensions reserved for the stage. */
+
+  /**
+   * Moves to a range of reserved dimensions of the current pixel sample, and
+   * reseeds the random stream for it.
+   */
+  void startDimensions(int first, int count);
+
+  /**
+   * Returns a hash of the seed, the current pixel, and the given dimension,
+   * for decorrelating the dimensions and pixels from one another.
+   */
+  unsigned hashDimension(int dim) const;
+
+  /** Returns the value of the current sample in the given dimension. */
+  virtual float sample1D(int dim) = 0;
+
+  /**
+   * Returns the values of the current sample in the given pair of
+   * dimensions, which are meant to be used together (e.g. as a position).
+   */
+  virtual Vec2 sample2D(int dim) = 0;
+
+  /**
+   * Reseeds the random values. Samplers with random state of their own must
+   * reseed it here too.
+   */
+  virtual void startStream(unsigned streamSeed);
+
+  /**
+   * Constructs a sampler.
+   *
+   * @param s the seed that scrambles the sequences; it must be the same for
+   *          every sampler of a render so that the samples of each pixel
+   *          belong to one sequence
+   */
+  Sampler(unsigned s);
+
+public:
+  virtual ~Sampler() {}
+
+  /**
+   * Creates a sampler of the given type.
+   *
+   * @param type the kind of sampler
+   * @param s    the seed that scrambles the sequences (see the constructor)
+   */
+  static std::unique_ptr<Sampler> create(SamplerType type, unsigned s);
+
+  /**
+   * Sets up the samples of a new iteration. Every pixel gets the same range
+   * of sample indices, which follow the indices of the previous iterations.
+   *
+   * @param first the index of the first sample of the iteration
+   * @param count the number of samples per pixel in the iteration
+   */
+  void startIteration(unsigned first, int count);
+
+  /**
+   * Starts (or resumes) a sample of a pixel, at its camera dimensions.
+   *
+   * @param x     the x-coordinate of the pixel
+   * @param y     the y-coordinate of the pixel
+   * @param index the index of the sample within the iteration
+   */
+  void startPixelSample(int x, int y, int index);
+
+  /** Moves to the direct-lighting dimensions of the given bounce. */
+  void startLighting(int depth);
+
+  /** Moves to the scattering dimensions of the given bounce. */
+  void startScattering(int depth);
+
+  /** Returns a value in [0, 1) for the next 1D decision. */
+  inline float next1D() {
+    if (dimension >= dimensionEnd) {
+      return rng.nextUnitFloat();
+    }
+    return sample1D(dimension++);
+  }
+
+  /** Returns a point in [0, 1)^2 for the next 2D decision. */
+  inline Vec2 next2D() {
+    if (dimension >= dimensionEnd) {
+      float u = rng.nextUnitFloat();
+      return Vec2(u, rng.nextUnitFloat());
+    }
+    return sample2D(dimension++);
+  }
+};
+
+/**
+ * Generates independent uniform random values. This is the simplest
+ * sampler, but its samples clump, so it converges the slowest. The values
+ * are hashed from a counter, RandomnessX8::WIDTH at a time, and handed out
+ * one by one; starting a new range of dimensions only resets the counter.
+ */
+class IndependentSampler : public Sampler {
+  RandomnessX8 wideRng; /**< Generates the values. */
+  float buffer[RandomnessX8::WIDTH]; /**< The last values generated. */
+  int bufferPos; /**< The next value in the buffer to hand out. */
+
+  /** Returns the next value in the buffer, refilling it if needed. */
+  inline float nextBuffered() {
+    if (bufferPos == RandomnessX8::WIDTH) {
+      wideRng.nextUnitFloats(buffer);
+      bufferPos = 0;
+    }
+    return buffer[bufferPos++];
+  }
+
+protected:
+  virtual float sample1D(int dim) override;
+  virtual Vec2 sample2D(int dim) override;
+  virtual void startStream(unsigned streamSeed) override;
+
+public:
+  IndependentSampler(unsigned s);
+};
+
+/**
+ * Splits each dimension (or pair of dimensions) into one stratum per sample
+ * of the iteration, and jitters each sample within its own stratum. The
+ * strata are matched to the samples by a different permutation in each
+ * dimension and pixel, so dimensions are not correlated.
+ *
+ * See Kensler, "Correlated Multi-Jittered Sampling" (2013), for the
+ * permutation.
+ */
+class StratifiedSampler : public Sampler {
+  /**
+   * Returns the position of i in a pseudorandom permutation of [0, count),
+   * where the permutation is chosen by key.
+   */
+  static unsigned permute(unsigned i, unsigned count, unsigned key);
+
+protected:
+  virtual float sample1D(int dim) override;
+  virtual Vec2 sample2D(int dim) override;
+
+public:
+  StratifiedSampler(unsigned s);
+};
+
+/**
+ * Uses the first two dimensions of the Sobol sequence for every pair of
+ * dimensions, with a hashed Owen scramble that differs per dimension and
+ * pixel, and a scrambled (shuffled) sample order so that dimensions are not
+ * correlated. Any power-of-two number of consecutive samples is well
+ * stratified, across iterations too. The Owen-scrambled points have the
+ * same stratification as progressive multi-jittered (0,2) points (see
+ * Helmer et al., "Stochastic Generation of (t, s) Sample Sequences" (2021)),
+ * so there is no separate pmj02 sampler.
+ *
+ * See Burley, "Practical Hash-based Owen Scrambling" (2020).
+ */
+class SobolSampler : public Sampler {
+protected:
+  virtual float sample1D(int dim) override;
+  virtual Vec2 sample2D(int dim) override;
+
+public:
+  SobolSampler(unsigned s);
+};
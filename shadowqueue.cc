@@ -0,0 +1,40 @@
+#include "shadowqueue.h"
+#include "accelerator.h"
+
+ShadowQueue::ShadowQueue()
+  : rays(), maxDists(), contributions(), owners(), occluded(),
+    occludedCapacity(0) {}
+
+void ShadowQueue::push(
+  size_t owner,
+  const Ray& r,
+  float maxDist,
+  const Vec& contribution
+) {
+  rays.push_back(r);
+  maxDists.push_back(maxDist);
+  contributions.push_back(contribution);
+  owners.push_back(owner);
+}
+
+void ShadowQueue::clear() {
+  rays.clear();
+  maxDists.clear();
+  contributions.clear();
+  owners.clear();
+}
+
+void ShadowQueue::testOcclusion(const Accelerator& accel) {
+  if (rays.empty()) {
+    return;
+  }
+
+  if (occludedCapacity < rays.size()) {
+    occludedCapacity = rays.capacity();
+    occluded.reset(new bool[occludedCapacity]);
+  }
+
+  accel.occludedMany(
+    rays.data(), maxDists.data(), rays.size(), occluded.get()
+  );
+}
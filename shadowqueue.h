@@ -0,0 +1,66 @@
+#pragma once
+#include "core.h"
+#include <memory>
+#include <vector>
+
+class Accelerator;
+
+/**
+ * Collects shadow rays, each with the radiance it would add to a path if it
+ * turns out to be unoccluded, so that they can be tested for occlusion
+ * together in one batch instead of one at a time in between shading.
+ *
+ * A queue is meant to be used by one thread at a time.
+ */
+class ShadowQueue {
+  std::vector<Ray> rays; /**< The queued shadow rays. */
+  std::vector<float> maxDists; /**< The distance to test along each ray. */
+  std::vector<Vec> contributions; /**< The radiance to add if unoccluded. */
+  std::vector<size_t> owners; /**< The path that each ray belongs to. */
+  std::unique_ptr<bool[]> occluded; /**< The occlusion results of a flush. */
+  size_t occludedCapacity; /**< The number of entries in occluded. */
+
+public:
+  ShadowQueue();
+
+  /**
+   * Queues a shadow ray.
+   *
+   * @param owner        an index identifying the path that the ray belongs
+   *                     to; passed back when the queue is flushed
+   * @param r            the shadow ray
+   * @param maxDist      the distance along the ray that must be unoccluded
+   * @param contribution the radiance to add to the path if the ray is
+   *                     unoccluded
+   */
+  void push(size_t owner, const Ray& r, float maxDist, const Vec& contribution);
+
+  /** The number of shadow rays waiting in the queue. */
+  inline size_t size() const { return rays.size(); }
+
+  /**
+   * Tests all queued shadow rays for occlusion in one batch, calls
+   * addRadiance(owner, contribution) for each one that is unoccluded, and
+   * then empties the queue.
+   *
+   * @param accel       the accelerator containing the scene geometry
+   * @param addRadiance a callable taking (size_t owner, const Vec& radiance)
+   */
+  template<typename F>
+  void flush(const Accelerator& accel, F addRadiance) {
+    testOcclusion(accel);
+    for (size_t i = 0; i < rays.size(); ++i) {
+      if (!occluded[i]) {
+        addRadiance(owners[i], contributions[i]);
+      }
+    }
+    clear();
+  }
+
+  /** Empties the queue without testing any rays. */
+  void clear();
+
+private:
+  /** Fills in occluded for every queued ray. */
+  void testOcclusion(const Accelerator& accel);
+};
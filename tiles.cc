@@ -0,0 +1,133 @@
+#include "tiles.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <chrono>
+#include <boost/format.hpp>
+
+namespace chrono = std::chrono;
+
+TileScheduler::TileScheduler(int ww, int hh, int ts)
+  : tiles(), timings(), lastWallTime(0.0f), w(ww), h(hh),
+    tileSize(ts > 0 ? ts : autoTileSize(ww, hh, numThreads()))
+{
+  int tilesX = (w + tileSize - 1) / tileSize;
+  int tilesY = (h + tileSize - 1) / tileSize;
+
+  // Sort the tile coordinates by their Morton code.
+  std::vector<std::pair<unsigned, std::pair<int, int>>> order;
+  order.reserve(size_t(tilesX * tilesY));
+  for (int ty = 0; ty < tilesY; ++ty) {
+    for (int tx = 0; tx < tilesX; ++tx) {
+      order.push_back(std::make_pair(
+        mortonCode(unsigned(tx), unsigned(ty)), std::make_pair(tx, ty)
+      ));
+    }
+  }
+  std::sort(order.begin(), order.end());
+
+  tiles.reserve(order.size());
+  for (const auto& o : order) {
+    int x0 = o.second.first * tileSize;
+    int y0 = o.second.second * tileSize;
+    tiles.push_back(Tile(
+      int(tiles.size()),
+      x0, y0, std::min(x0 + tileSize, w), std::min(y0 + tileSize, h)
+    ));
+  }
+
+  timings.resize(tiles.size(), 0.0f);
+}
+
+unsigned TileScheduler::mortonCode(unsigned x, unsigned y) {
+  // Spread the lower 16 bits of each coordinate out to the even bits.
+  // See <https://fgiesen.wordpress.com/2009/12/13/decoding-morton-codes/>.
+  auto part1By1 = [](unsigned v) {
+    v &= 0x0000ffff;
+    v = (v ^ (v << 8)) & 0x00ff00ff;
+    v = (v ^ (v << 4)) & 0x0f0f0f0f;
+    v = (v ^ (v << 2)) & 0x33333333;
+    v = (v ^ (v << 1)) & 0x55555555;
+    return v;
+  };
+
+  return (part1By1(y) << 1) | part1By1(x);
+}
+
+int TileScheduler::autoTileSize(int ww, int hh, int threads) {
+  float pixelsPerTile =
+    float(ww) * float(hh) / float(std::max(1, threads) * TILES_PER_THREAD);
+  float idealSize = sqrtf(pixelsPerTile);
+
+  // Round down to a power of two so that tiles line up with each other.
+  int size = MIN_TILE_SIZE;
+  while (size * 2 <= MAX_TILE_SIZE && float(size * 2) <= idealSize) {
+    size *= 2;
+  }
+
+  return size;
+}
+
+int TileScheduler::numThreads() {
+  // Ask the scheduler rather than the hardware, so that a limited arena
+  // (or a limit set on the command line) is respected.
+#ifdef _WIN32
+  int n = int(Concurrency::CurrentScheduler::GetNumberOfVirtualProcessors());
+  if (n <= 0) {
+    // No scheduler has been created for this thread yet.
+    n = int(Concurrency::GetProcessorCount());
+  }
+#else
+  int n = parallel::this_task_arena::max_concurrency();
+#endif
+  return n <= 0 ? 1 : n;
+}
+
+void TileScheduler::run(const std::function<void(const Tile&)>& fn) {
+  chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+
+  parallel::parallel_for(0, int(tiles.size()), [&](int i) {
+    chrono::steady_clock::time_point tileStart = chrono::steady_clock::now();
+
+    fn(tiles[size_t(i)]);
+
+    chrono::steady_clock::time_point tileEnd = chrono::steady_clock::now();
+    timings[size_t(i)] = chrono::duration_cast<chrono::duration<float>>(
+      tileEnd - tileStart
+    ).count();
+  });
+
+  chrono::steady_clock::time_point endTime = chrono::steady_clock::now();
+  lastWallTime = chrono::duration_cast<chrono::duration<float>>(
+    endTime - startTime
+  ).count();
+}
+
+void TileScheduler::printTimings(std::ostream& os) const {
+  if (timings.empty()) {
+    return;
+  }
+
+  float minTime = std::numeric_limits<float>::max();
+  float maxTime = 0.0f;
+  float totalTime = 0.0f;
+  for (float t : timings) {
+    minTime = std::min(minTime, t);
+    maxTime = std::max(maxTime, t);
+    totalTime += t;
+  }
+
+  float meanTime = totalTime / float(timings.size());
+  float imbalance = meanTime > 0.0f ? maxTime / meanTime : 1.0f;
+  float busy = lastWallTime > 0.0f
+    ? totalTime / (lastWallTime * float(numThreads()))
+    : 1.0f;
+
+  os << boost::format(
+      "%1% tiles (%2%px), min/mean/max %3$.1f/%4$.1f/%5$.1f ms, "
+      "imbalance %6$.2fx, threads %7$.0f%% busy"
+    ) % timings.size() % tileSize
+      % (minTime * 1000.0f) % (meanTime * 1000.0f) % (maxTime * 1000.0f)
+      % imbalance % (std::min(busy, 1.0f) * 100.0f);
+}
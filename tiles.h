@@ -0,0 +1,101 @@
+#pragma once
+#include <vector>
+#include <functional>
+#include <iostream>
+
+/**
+ * A rectangular block of pixels that is rendered as a single unit of work.
+ */
+struct Tile {
+  int index; /**< The index of the tile in scheduling order. */
+  int x0; /**< The leftmost pixel column of the tile (inclusive). */
+  int y0; /**< The topmost pixel row of the tile (inclusive). */
+  int x1; /**< The rightmost pixel column of the tile (exclusive). */
+  int y1; /**< The bottommost pixel row of the tile (exclusive). */
+
+  Tile(int i, int xx0, int yy0, int xx1, int yy1)
+    : index(i), x0(xx0), y0(yy0), x1(xx1), y1(yy1) {}
+
+  /** The number of pixels covered by the tile. */
+  inline int area() const { return (x1 - x0) * (y1 - y0); }
+};
+
+/**
+ * Splits an image into square tiles and runs a function over every tile in
+ * parallel. Tiles are ordered along a Morton (Z-order) curve so that nearby
+ * tiles are started close together in time, and are dealt out to the worker
+ * threads by the work-stealing scheduler of TBB (Linux/Mac) or PPL (Windows).
+ * Expensive tiles therefore don't leave other cores idle at the end of a pass
+ * the way that whole image rows do.
+ */
+class TileScheduler {
+  std::vector<Tile> tiles; /**< The tiles, sorted in Morton order. */
+  std::vector<float> timings; /**< Per-tile run times of the last pass (s). */
+  float lastWallTime; /**< The wall-clock time of the last pass (s). */
+
+  /** Interleaves the bits of x and y to produce a Morton code. */
+  static unsigned mortonCode(unsigned x, unsigned y);
+
+public:
+  /** The smallest tile size that will be picked automatically. */
+  static constexpr int MIN_TILE_SIZE = 8;
+  /** The largest tile size that will be picked automatically. */
+  static constexpr int MAX_TILE_SIZE = 64;
+  /**
+   * The number of tiles that each thread should get (on average) when the
+   * tile size is picked automatically. More tiles per thread leave more room
+   * for work stealing to even out the load.
+   */
+  static constexpr int TILES_PER_THREAD = 16;
+
+  const int w; /**< The width of the tiled image. */
+  const int h; /**< The height of the tiled image. */
+  const int tileSize; /**< The width and height of each (full) tile. */
+
+  /**
+   * Constructs a tile scheduler for an image.
+   *
+   * @param ww the width of the image, in pixels
+   * @param hh the height of the image, in pixels
+   * @param ts the width and height of each tile; if <= 0, then the tile size
+   *           is picked automatically from the resolution and core count
+   */
+  TileScheduler(int ww, int hh, int ts = 0);
+
+  /**
+   * Picks a power-of-two tile size such that each thread gets about
+   * TILES_PER_THREAD tiles, clamped to [MIN_TILE_SIZE, MAX_TILE_SIZE].
+   *
+   * @param ww      the width of the image, in pixels
+   * @param hh      the height of the image, in pixels
+   * @param threads the number of worker threads
+   */
+  static int autoTileSize(int ww, int hh, int threads);
+
+  /**
+   * Returns the number of worker threads that the task scheduler makes
+   * available for rendering.
+   */
+  static int numThreads();
+
+  /** Returns all of the tiles, in scheduling (Morton) order. */
+  inline const std::vector<Tile>& getTiles() const { return tiles; }
+
+  /** Returns the run time of each tile in the last pass, in seconds. */
+  inline const std::vector<float>& lastTimings() const { return timings; }
+
+  /**
+   * Runs a function over all tiles in parallel and records how long each tile
+   * took. The function must be safe to call concurrently on different tiles.
+   *
+   * @param fn the function to run for each tile
+   */
+  void run(const std::function<void(const Tile&)>& fn);
+
+  /**
+   * Prints a short summary of the per-tile timings of the last pass: the
+   * minimum, mean, and maximum tile times, the ratio of the slowest tile to
+   * the mean, and how busy the worker threads were over the whole pass.
+   */
+  void printTimings(std::ostream& os) const;
+};
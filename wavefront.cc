@@ -0,0 +1,186 @@
+#include "wavefront.h"
+#include "camera.h"
+#include "light.h"
+#include "material.h"
+#include <algorithm>
+#include <typeindex>
+#include <typeinfo>
+
+WavefrontIntegrator::WavefrontIntegrator(const Camera& c)
+  : cam(c), paths(), isects(), activeQueue(), hitQueue(), nextQueue(),
+    rayBatch(), hitBatch(), shadows() {}
+
+void WavefrontIntegrator::renderTile(
+  Sampler& sampler,
+  const Tile& tile,
+  Image& img
+) {
+  generateStage(sampler, tile, img);
+
+  while (!activeQueue.empty()) {
+    intersectStage();
+    emissionStage();
+    shadowStage(sampler);
+    shadeStage(sampler);
+    activeQueue.swap(nextQueue);
+  }
+
+  Image::TileBuffer buffer = img.startTile(tile);
+  for (const PathState& p : paths) {
+    img.setSample(
+      buffer, p.x, p.y, p.posX, p.posY, Camera::clampRadiance(p.L),
+      p.features
+    );
+  }
+  img.finishTile(buffer);
+}
+
+void WavefrontIntegrator::generateStage(
+  Sampler& sampler,
+  const Tile& tile,
+  const Image& img
+) {
+  const int samplesPerPixel = img.getSamplesPerPixel();
+  size_t maxPaths = size_t(tile.area() * samplesPerPixel);
+  paths.resize(maxPaths);
+  isects.resize(maxPaths);
+  activeQueue.resize(maxPaths);
+
+  size_t i = 0;
+  for (int y = tile.y0; y < tile.y1; ++y) {
+    for (int x = tile.x0; x < tile.x1; ++x) {
+      if (!img.isPixelActive(x, y)) {
+        // Skip pixels that adaptive sampling considers converged.
+        continue;
+      }
+
+      for (int samp = 0; samp < samplesPerPixel; ++samp) {
+        PathState& p = paths[i];
+        sampler.startPixelSample(x, y, samp);
+        p.ray = cam.generateRay(sampler, x, y, &p.posX, &p.posY);
+        p.beta = Vec(1, 1, 1);
+        p.L = Vec(0, 0, 0);
+        p.features = Image::Features();
+        p.x = x;
+        p.y = y;
+        p.sample = samp;
+        p.depth = 0;
+        p.didDirectIlluminate = false;
+
+        activeQueue[i] = i;
+        i++;
+      }
+    }
+  }
+
+  paths.resize(i);
+  isects.resize(i);
+  activeQueue.resize(i);
+}
+
+void WavefrontIntegrator::intersectStage() {
+  rayBatch.resize(activeQueue.size());
+  hitBatch.resize(activeQueue.size());
+  for (size_t j = 0; j < activeQueue.size(); ++j) {
+    rayBatch[j] = paths[activeQueue[j]].ray;
+  }
+
+  size_t numHits =
+    cam.accel.intersectMany(rayBatch.data(), rayBatch.size(), hitBatch.data());
+
+  // Paths without a hit record end in empty space.
+  hitQueue.resize(numHits);
+  for (size_t j = 0; j < numHits; ++j) {
+    size_t i = activeQueue[hitBatch[j].index];
+    isects[i] = hitBatch[j].isect;
+    hitQueue[j] = i;
+  }
+}
+
+void WavefrontIntegrator::emissionStage() {
+  for (size_t i : hitQueue) {
+    PathState& p = paths[i];
+    const Material* mat = isects[i].geom->mat;
+    const AreaLight* light = isects[i].geom->light;
+
+    if (p.depth == 0) {
+      p.features.albedo = mat ? mat->reflectance() : Vec(0, 0, 0);
+      p.features.normal = isects[i].normal;
+      p.features.position = isects[i].position;
+      p.features.depth = isects[i].distance;
+    }
+
+    // Same rule as Camera::trace: only count emission if we did not
+    // direct-illuminate at the last vertex.
+    if (light && !p.didDirectIlluminate) {
+      p.L += p.beta.cwiseProduct(light->emit(isects[i]));
+    }
+  }
+
+  // Group the paths by the type of their material, so that the later stages
+  // run the same BSDF code for long runs of paths, and then by the material
+  // itself, so that they also share its parameters.
+  auto materialType = [](const Material* mat) {
+    return mat ? std::type_index(typeid(*mat)) : std::type_index(typeid(void));
+  };
+  std::stable_sort(hitQueue.begin(), hitQueue.end(),
+    [this, &materialType](size_t a, size_t b) {
+      const Material* matA = isects[a].geom->mat;
+      const Material* matB = isects[b].geom->mat;
+      std::type_index typeA = materialType(matA);
+      std::type_index typeB = materialType(matB);
+      if (typeA != typeB) {
+        return typeA < typeB;
+      }
+      return matA < matB;
+    }
+  );
+}
+
+void WavefrontIntegrator::shadowStage(Sampler& sampler) {
+  for (size_t i : hitQueue) {
+    PathState& p = paths[i];
+    const Material* mat = isects[i].geom->mat;
+
+    if (mat && mat->shouldDirectIlluminate()) {
+#ifndef NO_DIRECT_ILLUM
+      // Resume the path's sample at this bounce's lighting dimensions.
+      sampler.startPixelSample(p.x, p.y, p.sample);
+      sampler.startLighting(p.depth);
+      cam.queueOneLight(sampler, isects[i], p.beta, i, &shadows);
+      p.didDirectIlluminate = true;
+#else
+      p.didDirectIlluminate = false;
+#endif
+    } else {
+      p.didDirectIlluminate = false;
+    }
+  }
+
+  shadows.flush(cam.accel, [this](size_t i, const Vec& L) {
+    paths[i].L += L;
+  });
+}
+
+void WavefrontIntegrator::shadeStage(Sampler& sampler) {
+  nextQueue.clear();
+
+  for (size_t i : hitQueue) {
+    PathState& p = paths[i];
+    const Material* mat = isects[i].geom->mat;
+
+    if (!mat) {
+      // Cannot continue path without a material.
+      continue;
+    }
+
+    sampler.startPixelSample(p.x, p.y, p.sample);
+    sampler.startScattering(p.depth);
+    mat->scatter(sampler, isects[i], &p.ray, &p.beta);
+
+    if (cam.russianRoulette(sampler, p.depth, &p.beta)) {
+      p.depth++;
+      nextQueue.push_back(i);
+    }
+  }
+}
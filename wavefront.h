@@ -0,0 +1,89 @@
+#pragma once
+#include "core.h"
+#include "sampler.h"
+#include "tiles.h"
+#include "accelerator.h"
+#include "shadowqueue.h"
+#include "image.h"
+#include <vector>
+
+class Camera;
+
+/**
+ * A path-tracing integrator that advances all of the paths in a tile together
+ * instead of following each path to its end before starting the next.
+ *
+ * Each bounce is split into stages that each run over a whole queue of rays:
+ * camera ray generation, intersection, emission, direct lighting (shadow
+ * rays), and shading (BSDF sampling and Russian Roulette). The shading queue
+ * is sorted by material type (and then by material), so consecutive rays run
+ * the same BSDF code.
+ *
+ * This computes the same estimator as Camera::trace, but gives the
+ * accelerator and the BSDF code large, coherent batches of work.
+ */
+class WavefrontIntegrator {
+  /**
+   * The state of a single path while it is in flight.
+   */
+  struct PathState {
+    Ray ray; /**< The next ray to trace along the path. */
+    Vec beta; /**< The current throughput of the path. */
+    Vec L; /**< The radiance accumulated so far. */
+    Image::Features features; /**< The surface at the path's first hit. */
+    float posX; /**< The x-position of the sample on the image plane. */
+    float posY; /**< The y-position of the sample on the image plane. */
+    int x; /**< The x-coordinate of the pixel for which the path was made. */
+    int y; /**< The y-coordinate of the pixel for which the path was made. */
+    int sample; /**< The index of the sample within its pixel. */
+    int depth; /**< The number of bounces so far. */
+    bool didDirectIlluminate; /**< Whether the last vertex sampled lights. */
+  };
+
+  const Camera& cam; /**< The camera whose scene is being rendered. */
+
+  std::vector<PathState> paths; /**< All paths in the current tile. */
+  std::vector<Intersection> isects; /**< The latest hit of each path. */
+  std::vector<size_t> activeQueue; /**< Paths that still need tracing. */
+  std::vector<size_t> hitQueue; /**< Paths that hit geometry this bounce. */
+  std::vector<size_t> nextQueue; /**< Paths that survive this bounce. */
+  std::vector<Ray> rayBatch; /**< The active rays, packed for the accel. */
+  std::vector<RayHit> hitBatch; /**< The hit records for rayBatch. */
+  ShadowQueue shadows; /**< The shadow rays of the direct lighting stage. */
+
+  /** Creates the camera rays for every sample of the tile's active pixels. */
+  void generateStage(Sampler& sampler, const Tile& tile, const Image& img);
+
+  /** Intersects all active rays and queues the ones that hit something. */
+  void intersectStage();
+
+  /**
+   * Adds emission for the paths that hit a light, and records the surface
+   * that each new path hit first.
+   */
+  void emissionStage();
+
+  /**
+   * Samples direct lighting for paths on direct-illuminable materials, and
+   * tests all of the resulting shadow rays together in one batch.
+   */
+  void shadowStage(Sampler& sampler);
+
+  /** Scatters the paths by material and applies Russian Roulette. */
+  void shadeStage(Sampler& sampler);
+
+public:
+  /**
+   * Constructs a wavefront integrator for the given camera.
+   */
+  WavefrontIntegrator(const Camera& c);
+
+  /**
+   * Traces all samples of a tile and stores them in the image.
+   *
+   * @param sampler the per-thread sampler in use
+   * @param tile    the tile to render
+   * @param img     the image that receives the samples
+   */
+  void renderTile(Sampler& sampler, const Tile& tile, Image& img);
+};